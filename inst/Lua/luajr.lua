@@ -53,7 +53,9 @@ enum
 {
     LOGICAL_R = 0, INTEGER_R = 1, NUMERIC_R = 2, CHARACTER_R = 3,
     LOGICAL_V = 4, INTEGER_V = 5, NUMERIC_V = 6, CHARACTER_V = 7,
-    LIST_T = 8, NULL_T = 16
+    LIST_T = 8, NULL_T = 16, MOVED_T = 32,
+    LOGICAL_M = 36, INTEGER_M = 37, NUMERIC_M = 38,
+    LOGICAL_MR = 64, INTEGER_MR = 65, NUMERIC_MR = 66
 };
 
 // Reference types
@@ -62,10 +64,32 @@ typedef struct { int* _p;    SEXP _s; } integer_rt;
 typedef struct { double* _p; SEXP _s; } numeric_rt;
 typedef struct { SEXP _s; } character_rt;
 
+// Matrix reference types
+typedef struct { int* _p;    SEXP _s; int nrow; int ncol; } logical_matrix_rt;
+typedef struct { int* _p;    SEXP _s; int nrow; int ncol; } integer_matrix_rt;
+typedef struct { double* _p; SEXP _s; int nrow; int ncol; } numeric_matrix_rt;
+
 // Vector types
-typedef struct { int* p;    double n; double c; } logical_vt;
-typedef struct { int* p;    double n; double c; } integer_vt;
-typedef struct { double* p; double n; double c; } numeric_vt;
+typedef struct { int* p;    double n; double c; SEXP _s; } logical_vt;
+typedef struct { int* p;    double n; double c; SEXP _s; } integer_vt;
+typedef struct { double* p; double n; double c; SEXP _s; } numeric_vt;
+
+// Read-only slice types (see luajr.map_slicer)
+typedef struct { const int* _p;    int n; } logical_st;
+typedef struct { const int* _p;    int n; } integer_st;
+typedef struct { const double* _p; int n; } numeric_st;
+typedef struct { const int* _p;    int nrow; int ncol; } logical_matrix_st;
+typedef struct { const int* _p;    int nrow; int ncol; } integer_matrix_st;
+typedef struct { const double* _p; int nrow; int ncol; } numeric_matrix_st;
+
+// Row and column views of matrix reference types and matrix slices
+typedef struct { int* _p;          int s; int n; } int_view_t;
+typedef struct { double* _p;       int s; int n; } double_view_t;
+typedef struct { const int* _p;    int s; int n; } int_slice_view_t;
+typedef struct { const double* _p; int s; int n; } double_slice_view_t;
+
+// Moved vector type (see luajr.move)
+typedef struct { void* p; double n; int type; } moved_vt;
 
 // Dummy NULL type
 typedef struct { int _; } NULL_t;
@@ -83,6 +107,9 @@ void SetLogicalRef(logical_rt* x, SEXP s);
 void SetIntegerRef(integer_rt* x, SEXP s);
 void SetNumericRef(numeric_rt* x, SEXP s);
 void SetCharacterRef(character_rt* x, SEXP s);
+void SetLogicalMatrixRef(logical_matrix_rt* x, SEXP s);
+void SetIntegerMatrixRef(integer_matrix_rt* x, SEXP s);
+void SetNumericMatrixRef(numeric_matrix_rt* x, SEXP s);
 
 // Functions to allocate reference types
 // The Alloc* functions call R_PreserveObject() on the underlying SEXP, so we
@@ -94,12 +121,19 @@ void AllocNumeric(numeric_rt* x, ptrdiff_t size);
 void AllocCharacter(character_rt* x, ptrdiff_t size);
 void AllocCharacterNA(character_rt* x, ptrdiff_t size);
 void AllocCharacterTo(character_rt* x, ptrdiff_t size, const char* v);
+void AllocLogicalMatrix(logical_matrix_rt* x, int nrow, int ncol);
+void AllocIntegerMatrix(integer_matrix_rt* x, int nrow, int ncol);
+void AllocNumericMatrix(numeric_matrix_rt* x, int nrow, int ncol);
 void Release(SEXP s);
+void ReleaseShared(SEXP s);
 
 // Functions to populate vector types
 void SetLogicalVec(logical_vt* x, SEXP s);
 void SetIntegerVec(integer_vt* x, SEXP s);
 void SetNumericVec(numeric_vt* x, SEXP s);
+int ShareLogicalVec(logical_vt* x, SEXP s);
+int ShareIntegerVec(integer_vt* x, SEXP s);
+int ShareNumericVec(numeric_vt* x, SEXP s);
 // character handled separately
 
 // Functions to get attributes
@@ -355,6 +389,122 @@ luajr.is_integer_r   = function(obj) return ffi.istype(luajr.integer_r, obj) end
 luajr.is_numeric_r   = function(obj) return ffi.istype(luajr.numeric_r, obj) end
 luajr.is_character_r = function(obj) return ffi.istype(luajr.character_r, obj) end
 
+-- Matrix reference types refer to an R matrix, like the reference types above,
+-- and also hold its dimensions. _p is offset so that element (i, j) is
+-- _p[i + j * nrow]. m[i] is a view of row i, so m[i][j] is element (i, j);
+-- m:get(i, j) and m:set(i, j, v) access elements directly. m:row(i) and
+-- m:col(j) are views of a row or column that use the matrix's memory.
+
+-- Metatable for row and column views of matrix reference types (and of
+-- matrix slices, below). A view is a small cdata object with a pointer into
+-- the matrix's memory, stride s and length n, with element k at _p[k * s].
+-- Unlike a table, the JIT compiler can usually avoid creating the view at
+-- all, so m[i][j] in a loop costs about as much as m:get(i, j). Like other
+-- pointers, a view does not keep the matrix alive, so the matrix must be
+-- kept for as long as its views are used.
+local mt_matrix_view = {
+    __index = function(v, k)
+        return v._p[k * v.s]
+    end,
+
+    __newindex = function(v, k, x)
+        v._p[k * v.s] = x
+    end,
+
+    __len = function(v)
+        return v.n
+    end,
+
+    __pairs = function(v)
+        return function(t, k)
+            k = k + 1
+            if k > t.n then return nil end
+            return k, t._p[k * t.s]
+        end, v, 0
+    end
+}
+mt_matrix_view.__ipairs = mt_matrix_view.__pairs
+
+local int_view = ffi.metatype("int_view_t", mt_matrix_view)
+local double_view = ffi.metatype("double_view_t", mt_matrix_view)
+
+-- Metatable for logical/integer/numeric matrix reference types, whose row
+-- and column views have cdata type view
+local mt_matrix_r = function(allocator, view)
+    local methods = {
+        get = function(x, i, j)
+            return x._p[i + j * x.nrow]
+        end,
+
+        set = function(x, i, j, v)
+            x._p[i + j * x.nrow] = v
+        end,
+
+        row = function(x, i)
+            return view(x._p + i, x.nrow, x.ncol)
+        end,
+
+        col = function(x, j)
+            return view(x._p + j * x.nrow, 1, x.nrow)
+        end
+    }
+
+    local mt = {
+        __new = function(ctype, nrow, ncol, init)
+            local self = ffi.new(ctype)
+            if nrow == hidden then
+                -- do nothing
+            elseif type(nrow) == "number" and type(ncol) == "number" then
+                allocator(self, nrow, ncol)
+                if init ~= nil then
+                    for k = self.nrow + 1, self.nrow * (self.ncol + 1) do self._p[k] = init end
+                end
+            else
+                error("Matrix reference type must be initialised with nrow and ncol.")
+            end
+            return self
+        end,
+
+        __gc = function(x)
+            internal.Release(x._s)
+        end,
+
+        __len = function(x)
+            return x.nrow * x.ncol
+        end,
+
+        __index = function(x, k)
+            if type(k) == "number" then
+                return view(x._p + k, x.nrow, x.ncol)
+            else
+                return methods[k]
+            end
+        end,
+
+        __call = function(x, k, v)
+            if type(k) ~= "string" then
+                error("Can only set string-keyed attributes.")
+            end
+            if v == nil then
+                return sexp_get_attr(x._s, k)
+            else
+                sexp_set_attr(x._s, k, v)
+            end
+        end
+    }
+    return mt
+end
+
+-- Matrix reference type definitions
+luajr.logical_matrix_r = ffi.metatype("logical_matrix_rt", mt_matrix_r(internal.AllocLogicalMatrix, int_view))
+luajr.integer_matrix_r = ffi.metatype("integer_matrix_rt", mt_matrix_r(internal.AllocIntegerMatrix, int_view))
+luajr.numeric_matrix_r = ffi.metatype("numeric_matrix_rt", mt_matrix_r(internal.AllocNumericMatrix, double_view))
+
+-- Matrix reference type checkers
+luajr.is_logical_matrix_r = function(obj) return ffi.istype(luajr.logical_matrix_r, obj) end
+luajr.is_integer_matrix_r = function(obj) return ffi.istype(luajr.integer_matrix_r, obj) end
+luajr.is_numeric_matrix_r = function(obj) return ffi.istype(luajr.numeric_matrix_r, obj) end
+
 
 ---------------------
 -- 4. VECTOR TYPES --
@@ -414,6 +564,29 @@ local vec_realloc = function(p, vtype, ptype, nelem, init1, init2)
     return new_p
 end
 
+-- Copy-on-write for vector types. A vector passed in from R (see
+-- luajr.construct_vec) may share its memory with an R vector, held by _s,
+-- instead of holding its own copy. This gives the vector its own copy of its
+-- contents, and must be called before anything that modifies the vector's
+-- memory.
+local vec_own = function(self, vtype)
+    if self._s ~= nullptr then
+        local new_p = nullptr
+        if self.n > 0 then
+            new_p = ffi.cast(ffi.typeof(self.p), malloc(sizeof(vtype, self.n)))
+            if new_p == nullptr then
+                error("Could not allocate memory in vec_own.")
+            end
+            ffi.copy(new_p, self.p + 1, sizeof(vtype, self.n))
+            new_p = new_p - 1
+        end
+        internal.ReleaseShared(self._s)
+        self._s = nullptr
+        self.p = new_p
+        self.c = self.n
+    end
+end
+
 -- Metatable for logical/integer/numeric vector
 local mt_basic_v = function(ct)
     local vtype = ffi.typeof(ct .. "[?]")
@@ -423,6 +596,7 @@ local mt_basic_v = function(ct)
     -- TODO consistent way of handling bad arguments ... ?
     local methods = {
         assign = function(self, a, b)
+            vec_own(self, vtype)
             if a == nil and b == nil then
                 self.n = 0
             elseif type(a) == "number" and (type(b) == "number" or type(b) == "boolean" or b == nil) then
@@ -489,6 +663,7 @@ local mt_basic_v = function(ct)
         -- Capacity
         reserve = function(self, n)
             if n == nil then error("must specify new reserved size", 2) end
+            vec_own(self, vtype)
             if n > self.c then
                 self.p = vec_realloc(self.p, vtype, ptype, n, self.p, self.n)
                 self.c = n
@@ -500,6 +675,7 @@ local mt_basic_v = function(ct)
         end,
 
         shrink_to_fit = function(self)
+            vec_own(self, vtype)
             if self.n < self.c then
                 self.p = vec_realloc(self.p, vtype, ptype, self.n, self.p)
                 self.c = self.n
@@ -510,9 +686,11 @@ local mt_basic_v = function(ct)
         clear = function(self)
             -- Don't reallocate, just shrink to 0
             self.n = 0
+            vec_own(self, vtype)
         end,
 
         resize = function(self, n, val)
+            vec_own(self, vtype)
             if n <= self.n then -- fail if n==nil
                 -- If shrinking, just decrease bound
                 self.n = n
@@ -534,6 +712,7 @@ local mt_basic_v = function(ct)
         end,
 
         push_back = function(self, val)
+            vec_own(self, vtype)
             if self.c > self.n then
                 -- If capacty allows, just assign new value
                 self.p[self.n + 1] = val -- fail if val == nil
@@ -556,8 +735,30 @@ local mt_basic_v = function(ct)
             end
         end,
 
+        -- Append the first n elements (default: all) of a vector, vector-ish
+        -- object or block (see luajr.chunks). Capacity grows geometrically,
+        -- so a long vector can be built up from many blocks.
+        append = function(self, a, n)
+            vec_own(self, vtype)
+            n = n or #a
+            if self.n + n > self.c then
+                local new_c = math.max(self.c * 2, self.n + n)
+                self.p = vec_realloc(self.p, vtype, ptype, new_c, self.p, self.n)
+                self.c = new_c
+            end
+            if ffi.istype(self, a) then
+                ffi.copy(self.p + self.n + 1, a.p + 1, sizeof(vtype, n))
+            elseif vectorish(a) then
+                for j = 1, n do self.p[self.n + j] = a[j] end
+            else
+                error("cannot use vector:append with argument type " .. type(a) .. ".", 2)
+            end
+            self.n = self.n + n
+        end,
+
         insert = function(self, i, a, b)
             if i == nil then error("must specify insertion point", 2) end
+            vec_own(self, vtype)
             if type(a) == "number" and type(b) == "number" then
                 -- a copies of b
                 if self.n + a <= self.c then
@@ -602,6 +803,7 @@ local mt_basic_v = function(ct)
 
         erase = function(self, first, last)
             if last == nil then last = first end
+            vec_own(self, vtype)
             local ndel = last - first + 1
             for i = first, self.n - ndel do self.p[i] = self.p[i + ndel] end
             self.n = self.n - ndel
@@ -639,7 +841,9 @@ local mt_basic_v = function(ct)
         end,
 
         __gc = function(self)
-            if self.p ~= nullptr then
+            if self._s ~= nullptr then
+                internal.ReleaseShared(self._s)
+            elseif self.p ~= nullptr then
                 ffi.C.free(self.p + 1)
             end
         end,
@@ -657,6 +861,7 @@ local mt_basic_v = function(ct)
         end,
 
         __newindex = function(self, k, v)
+            if self._s ~= nullptr then vec_own(self, vtype) end
             self.p[k] = v
         end,
 
@@ -767,6 +972,12 @@ mt_character_v = {
         table.remove(rawget(self, 0))
     end,
 
+    append = function(self, a, n)
+        local t = rawget(self, 0)
+        local k = #t
+        for j = 1, n or #a do t[k + j] = tostring2(a[j]) end
+    end,
+
     insert = function(self, i, a, b)
         nt = new_character_v(a, b)
         for j = #self,i,-1 do rawget(self, 0)[j + #nt] = rawget(self, 0)[j] end
@@ -819,6 +1030,45 @@ luajr.is_integer   = function(obj) return ffi.istype(luajr.integer, obj) end
 luajr.is_numeric   = function(obj) return ffi.istype(luajr.numeric, obj) end
 luajr.is_character = function(obj) return getmetatable(obj) == mt_character_v end
 
+-- Moved vector type: holds the memory of a vector that is to be returned to R
+-- without copying. p points to the first element, not to one before it.
+local moved_vt = ffi.metatype("moved_vt", {
+    __gc = function(self)
+        if self.p ~= nullptr then
+            ffi.C.free(self.p)
+        end
+    end,
+
+    __len = function(self)
+        return self.n
+    end
+})
+
+-- Move the contents of a logical, integer, or numeric vector into an object
+-- that, when returned to R, hands its memory over to R instead of being
+-- copied. The vector v is left empty.
+luajr.move = function(v)
+    local code, vtype
+    if     luajr.is_logical(v) then code, vtype = internal.LOGICAL_M, "int[?]"
+    elseif luajr.is_integer(v) then code, vtype = internal.INTEGER_M, "int[?]"
+    elseif luajr.is_numeric(v) then code, vtype = internal.NUMERIC_M, "double[?]"
+    else
+        error("luajr.move can only be used with logical, integer, or numeric vectors.", 2)
+    end
+    vec_own(v, vtype)
+
+    local m = moved_vt()
+    m.type = code
+    m.n = v.n
+    if v.p ~= nullptr then m.p = v.p + 1 end
+    v.p = nullptr
+    v.n = 0
+    v.c = 0
+    return m
+end
+
+luajr.is_moved = function(obj) return ffi.istype(moved_vt, obj) end
+
 
 ------------------
 -- 5. LIST TYPE --
@@ -970,6 +1220,18 @@ local vec_set = {
     -- CHARACTER_V handled separately
 }
 
+-- Helpers to share the memory of existing R objects with vector objects when
+-- passing in (copy-on-write, see vec_own)
+local vec_share = {
+    [internal.LOGICAL_V]   = internal.ShareLogicalVec,
+    [internal.INTEGER_V]   = internal.ShareIntegerVec,
+    [internal.NUMERIC_V]   = internal.ShareNumericVec
+}
+
+-- Vectors passed in from R with at least this many elements share memory with
+-- the R vector until they are first modified, rather than being copied.
+luajr.cow_min = 2^16
+
 -- Construct a reference type. Called with:
 --   ud = SEXP to be referenced
 --   typecode = e.g. internal.LOGICAL_R, etc
@@ -980,7 +1242,7 @@ luajr.construct_ref = function(ud, typecode)
 end
 
 -- Construct a vector type. Called with:
---   ud = SEXP to be copied
+--   ud = SEXP to be copied (or shared, if it has at least luajr.cow_min elements)
 --   typecode = e.g. internal.LOGICAL_V, etc
 luajr.construct_vec = function(ud, typecode)
     if typecode == internal.CHARACTER_V then
@@ -995,7 +1257,14 @@ luajr.construct_vec = function(ud, typecode)
         end
         return x
     else
-        local x = vec_type[typecode](internal.SEXP_length(ud), 0)
+        local n = internal.SEXP_length(ud)
+        if n >= luajr.cow_min then
+            local x = vec_type[typecode]()
+            if vec_share[typecode](x, ud) ~= 0 then
+                return x
+            end
+        end
+        local x = vec_type[typecode](n)
         vec_set[typecode](x, ud)
         return x
     end
@@ -1021,57 +1290,25 @@ end
 -- 7. RETURN TO R --
 --------------------
 
--- Helps return luajr objects to R
--- When passed a luajr object, returns two values:
---    1, an integer type code from the internal api
---    2, a pointer to the object's internal SEXP, if the object is a reference;
---       or the number of elements in that object, if the object is a vector/list.
--- If the object is not a luajr type (e.g. a plain Lua type) returns nil, nil.
-function luajr.return_info(obj)
-    if     luajr.is_logical_r(obj)      then return internal.LOGICAL_R, ffi.cast("void*", obj._s)
-    elseif luajr.is_integer_r(obj)      then return internal.INTEGER_R, ffi.cast("void*", obj._s)
-    elseif luajr.is_numeric_r(obj)      then return internal.NUMERIC_R, ffi.cast("void*", obj._s)
-    elseif luajr.is_character_r(obj)    then return internal.CHARACTER_R, ffi.cast("void*", obj._s)
-
-    elseif luajr.is_logical(obj)        then return internal.LOGICAL_V, #obj
-    elseif luajr.is_integer(obj)        then return internal.INTEGER_V, #obj
-    elseif luajr.is_numeric(obj)        then return internal.NUMERIC_V, #obj
-    elseif luajr.is_character(obj)      then return internal.CHARACTER_V, #obj
-    elseif luajr.is_list(obj)           then return internal.LIST_T, #obj
-    elseif obj == nullptr               then return internal.NULL_T, 0
-    elseif ffi.istype(luajr.NULL, obj)  then return internal.NULL_T, 0
-    end
-
-    return nil, nil
-end
-
--- Copies a luajr object to allocated memory so that it can be taken in by R.
---   obj is the luajr object;
---   ptr is a SEXP* (_pointer_ to SEXP) if obj is a reference type;
---     or the start of some contiguous memory if obj is a basic vector type;
---     or a SEXP if obj is a character vector.
-function luajr.return_copy(obj, ptr)
-    if luajr.is_logical_r(obj) or luajr.is_integer_r(obj) or
-       luajr.is_numeric_r(obj) or luajr.is_character_r(obj) then
-        internal.SetPtr(ptr, obj._s)
-    elseif luajr.is_logical(obj) then
-        ffi.copy(ffi.cast("int*", ptr), obj.p + 1, sizeof("int[?]", obj.n))
-    elseif luajr.is_integer(obj) then
-        ffi.copy(ffi.cast("int*", ptr), obj.p + 1, sizeof("int[?]", obj.n))
-    elseif luajr.is_numeric(obj) then
-        ffi.copy(ffi.cast("double*", ptr), obj.p + 1, sizeof("double[?]", obj.n))
-    elseif luajr.is_character(obj) then
-        for k,v in ipairs(obj) do
-            if v == luajr.NA_character_ then
-                internal.SetCharacterElt(ffi.cast("SEXP", ptr), k - 1, nullptr)
-            else
-                internal.SetCharacterElt(ffi.cast("SEXP", ptr), k - 1, v)
-            end
-        end
-    else
-        error("luajr.return_copy should not be called with an object of this type.")
-    end
-end
+-- Maps the CTypeIDs of luajr cdata types to their type codes, so that these
+-- types can be identified from C++ when they are returned to R (see
+-- push_to.cpp). Moved vectors map to MOVED_T; their full type code is in the
+-- object itself. List and character vector tables are identified by their
+-- metatables.
+luajr.ctype_codes = {
+    [tonumber(luajr.logical_r)]         = internal.LOGICAL_R,
+    [tonumber(luajr.integer_r)]         = internal.INTEGER_R,
+    [tonumber(luajr.numeric_r)]         = internal.NUMERIC_R,
+    [tonumber(luajr.character_r)]       = internal.CHARACTER_R,
+    [tonumber(luajr.logical_matrix_r)]  = internal.LOGICAL_MR,
+    [tonumber(luajr.integer_matrix_r)]  = internal.INTEGER_MR,
+    [tonumber(luajr.numeric_matrix_r)]  = internal.NUMERIC_MR,
+    [tonumber(luajr.logical)]           = internal.LOGICAL_V,
+    [tonumber(luajr.integer)]           = internal.INTEGER_V,
+    [tonumber(luajr.numeric)]           = internal.NUMERIC_V,
+    [tonumber(moved_vt)]                = internal.MOVED_T,
+    [tonumber(ffi.typeof(luajr.NULL))]  = internal.NULL_T
+}
 
 
 --------------------
@@ -1144,6 +1381,215 @@ function luajr.datamatrix_r(nrow, ncol, names)
     return m
 end
 
+-- Chunked view: gives access to a vector or reference type x in blocks of a
+-- fixed size, so that a vector of any length can be processed with tables of
+-- a bounded size. Passing a vector with arg code 'c' gives a chunked view of
+-- it as a reference type. The view is stored as { [0] = x, size = size }.
+local mt_chunked
+mt_chunked = {
+    __index = function(self, k)
+        if type(k) == "number" then
+            return rawget(self, 0)[k]
+        else
+            return mt_chunked[k]
+        end
+    end,
+
+    __len = function(self)
+        return #rawget(self, 0)
+    end,
+
+    -- Iterate over blocks; see luajr.chunks
+    chunks = function(self, size)
+        return luajr.chunks(rawget(self, 0), size or rawget(self, "size"))
+    end,
+
+    -- Get the underlying vector or reference type
+    source = function(self)
+        return rawget(self, 0)
+    end
+}
+
+-- Default block size for chunked views
+luajr.chunk_size = 4096
+
+-- Create a chunked view of x, with blocks of the given size
+luajr.chunked = function(x, size)
+    local view = { [0] = x, size = size or luajr.chunk_size }
+    setmetatable(view, mt_chunked)
+    return view
+end
+
+luajr.is_chunked = function(obj) return getmetatable(obj) == mt_chunked end
+
+-- Iterate over x in blocks of up to size elements, e.g.
+--   for i, block, n in luajr.chunks(x, 1000) do ... end
+-- where x is a chunked view, vector, reference type or table. On each step,
+-- block is a table holding elements i to i + n - 1 of x at keys 1 to n. The
+-- same table is reused for every block, so it should be copied if needed
+-- beyond the current step.
+luajr.chunks = function(x, size)
+    if luajr.is_chunked(x) then
+        size = size or rawget(x, "size")
+        x = rawget(x, 0)
+    end
+    size = size or luajr.chunk_size
+    if size < 1 then error("Block size must be at least 1.", 2) end
+
+    local n = #x
+    local block = table.new(math.min(size, n), 0)
+    local i0 = 0
+    return function()
+        if i0 >= n then return nil end
+        local m = math.min(size, n - i0)
+        for j = 1, m do block[j] = x[i0 + j] end
+        for j = m + 1, #block do block[j] = nil end
+        local first = i0 + 1
+        i0 = i0 + m
+        return first, block, m
+    end
+end
+
+
+-- Slices are read-only views of part of an R vector, matrix, or data frame,
+-- used by lua_parallel_map. Unlike reference types, they do not refer to the
+-- R object itself, so they can be created and used in any thread. A slice of
+-- a vector has _p offset so that element i is _p[i]; a slice of a matrix has
+-- _p offset so that element (i, j) is _p[i + j * nrow], like a matrix
+-- reference type. Writing to a slice is an error.
+
+-- Metatable for vector slices
+local mt_slice = {
+    __index = function(x, k)
+        return x._p[k]
+    end,
+
+    __newindex = function(x, k, v)
+        error("Cannot assign to a read-only slice.", 2)
+    end,
+
+    __len = function(x)
+        return x.n
+    end,
+
+    __pairs = function(x)
+        return function(t, k)
+            k = k + 1
+            if k > t.n then return nil end
+            return k, t._p[k]
+        end, x, 0
+    end
+}
+mt_slice.__ipairs = mt_slice.__pairs
+
+-- Row and column views of matrix slices, which are read-only like the slices
+local mt_slice_view = {
+    __index = mt_matrix_view.__index,
+    __newindex = mt_slice.__newindex,
+    __len = mt_matrix_view.__len,
+    __pairs = mt_matrix_view.__pairs,
+    __ipairs = mt_matrix_view.__ipairs
+}
+local int_slice_view = ffi.metatype("int_slice_view_t", mt_slice_view)
+local double_slice_view = ffi.metatype("double_slice_view_t", mt_slice_view)
+
+-- Metatable for matrix slices, whose row and column views have cdata type
+-- view
+local mt_matrix_slice = function(view)
+    local methods = {
+        get = function(x, i, j)
+            return x._p[i + j * x.nrow]
+        end,
+
+        row = function(x, i)
+            return view(x._p + i, x.nrow, x.ncol)
+        end,
+
+        col = function(x, j)
+            return view(x._p + j * x.nrow, 1, x.nrow)
+        end
+    }
+
+    return {
+        __index = function(x, k)
+            if type(k) == "number" then
+                return view(x._p + k, x.nrow, x.ncol)
+            else
+                return methods[k]
+            end
+        end,
+
+        __newindex = mt_slice.__newindex,
+
+        __len = function(x)
+            return x.nrow * x.ncol
+        end
+    }
+end
+
+-- Slice type definitions, indexed by type code
+local slice_type = {
+    [internal.LOGICAL_R] = ffi.metatype("logical_st", mt_slice),
+    [internal.INTEGER_R] = ffi.metatype("integer_st", mt_slice),
+    [internal.NUMERIC_R] = ffi.metatype("numeric_st", mt_slice)
+}
+local matrix_slice_type = {
+    [internal.LOGICAL_R] = ffi.metatype("logical_matrix_st", mt_matrix_slice(int_slice_view)),
+    [internal.INTEGER_R] = ffi.metatype("integer_matrix_st", mt_matrix_slice(int_slice_view)),
+    [internal.NUMERIC_R] = ffi.metatype("numeric_matrix_st", mt_matrix_slice(double_slice_view))
+}
+local slice_ptr = {
+    [internal.LOGICAL_R] = ffi.typeof("const int*"),
+    [internal.INTEGER_R] = ffi.typeof("const int*"),
+    [internal.NUMERIC_R] = ffi.typeof("const double*")
+}
+
+-- Slice checker
+luajr.is_slice = function(obj)
+    for _, ct in pairs(slice_type) do
+        if ffi.istype(ct, obj) then return true end
+    end
+    for _, ct in pairs(matrix_slice_type) do
+        if ffi.istype(ct, obj) then return true end
+    end
+    return false
+end
+
+-- Wrap func for lua_parallel_map (see parallel.cpp). Returns a function of
+-- (first, last) which calls func(x, first, last), where x is a slice of
+-- elements first to last of a vector (kind 0), columns first to last of a
+-- matrix with nrow rows (kind 1), or rows first to last of a data frame
+-- (kind 2), as a luajr.list of slices of its columns. ptrs, types and names
+-- hold the data pointer (as light userdata), type code and name of each
+-- column of the R object.
+luajr.map_slicer = function(func, kind, nrow, ptrs, types, names)
+    -- Pointers to one before the first element of each column
+    local base = {}
+    for c = 1, #ptrs do
+        base[c] = ffi.cast(slice_ptr[types[c]], ptrs[c]) - 1
+    end
+
+    if kind == 0 then
+        local st, b = slice_type[types[1]], base[1]
+        return function(first, last)
+            return func(st(b + first - 1, last - first + 1), first, last)
+        end
+    elseif kind == 1 then
+        local st, b = matrix_slice_type[types[1]], base[1]
+        return function(first, last)
+            return func(st(b + (first - 2) * nrow, nrow, last - first + 1), first, last)
+        end
+    else
+        return function(first, last)
+            local x = luajr.dataframe()
+            for c = 1, #base do
+                local col = slice_type[types[c]](base[c] + first - 1, last - first + 1)
+                if names[c] ~= "" then x[names[c]] = col else x[c] = col end
+            end
+            return func(x, first, last)
+        end
+    end
+end
 
 -----------------
 -- 9. DEBUGGER --
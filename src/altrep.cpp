@@ -0,0 +1,126 @@
+#include "shared.h"
+#include <cstdlib>
+#define R_NO_REMAP
+#include <R.h>
+#include <Rinternals.h>
+#include <R_ext/Altrep.h>
+#include <R_ext/Rdynload.h>
+
+// ALTREP classes for vectors moved from Lua to R with luajr.move().
+//
+// These wrap a buffer that was malloc'd by a luajr.logical, luajr.integer, or
+// luajr.numeric vector, so that the vector can be returned to R without
+// copying. data1 is an external pointer which owns the buffer and frees it
+// when the object is garbage collected; data2 is the length as a double.
+// Methods not provided here (e.g. Duplicate, Serialized_state) fall back to
+// R's defaults, which work through Dataptr, so duplicated or serialized
+// objects become ordinary R vectors.
+
+static R_altrep_class_t luajr_altreal;
+static R_altrep_class_t luajr_altinteger;
+static R_altrep_class_t luajr_altlogical;
+
+// Finalizer for the external pointer in data1
+static void altrep_finalize(SEXP ptr)
+{
+    std::free(R_ExternalPtrAddr(ptr));
+    R_ClearExternalPtr(ptr);
+}
+
+// Common methods
+static R_xlen_t altrep_Length(SEXP x)
+{
+    return (R_xlen_t)REAL(R_altrep_data2(x))[0];
+}
+
+static Rboolean altrep_Inspect(SEXP x, int pre, int deep, int pvec,
+    void (*inspect_subtree)(SEXP, int, int, int))
+{
+    Rprintf(" luajr moved vector (len=%.0f, ptr=%p)\n",
+        (double)altrep_Length(x), R_ExternalPtrAddr(R_altrep_data1(x)));
+    return TRUE;
+}
+
+static void* altrep_Dataptr(SEXP x, Rboolean writeable)
+{
+    return R_ExternalPtrAddr(R_altrep_data1(x));
+}
+
+static const void* altrep_Dataptr_or_null(SEXP x)
+{
+    return R_ExternalPtrAddr(R_altrep_data1(x));
+}
+
+// Element accessors
+static double altreal_Elt(SEXP x, R_xlen_t i)
+{
+    return ((double*)R_ExternalPtrAddr(R_altrep_data1(x)))[i];
+}
+
+static int altinteger_Elt(SEXP x, R_xlen_t i)
+{
+    return ((int*)R_ExternalPtrAddr(R_altrep_data1(x)))[i];
+}
+
+static int altlogical_Elt(SEXP x, R_xlen_t i)
+{
+    return ((int*)R_ExternalPtrAddr(R_altrep_data1(x)))[i];
+}
+
+// Set the methods shared by all three classes
+static void altrep_set_common(R_altrep_class_t cls)
+{
+    R_set_altrep_Length_method(cls, altrep_Length);
+    R_set_altrep_Inspect_method(cls, altrep_Inspect);
+    R_set_altvec_Dataptr_method(cls, altrep_Dataptr);
+    R_set_altvec_Dataptr_or_null_method(cls, altrep_Dataptr_or_null);
+}
+
+// Register the ALTREP classes; called from R_init_luajr
+extern "C" void luajr_init_altrep(DllInfo* dll)
+{
+    luajr_altreal = R_make_altreal_class("luajr_altreal", "luajr", dll);
+    altrep_set_common(luajr_altreal);
+    R_set_altreal_Elt_method(luajr_altreal, altreal_Elt);
+
+    luajr_altinteger = R_make_altinteger_class("luajr_altinteger", "luajr", dll);
+    altrep_set_common(luajr_altinteger);
+    R_set_altinteger_Elt_method(luajr_altinteger, altinteger_Elt);
+
+    luajr_altlogical = R_make_altlogical_class("luajr_altlogical", "luajr", dll);
+    altrep_set_common(luajr_altlogical);
+    R_set_altlogical_Elt_method(luajr_altlogical, altlogical_Elt);
+}
+
+// Make an R vector of type rtype (LGLSXP, INTSXP or REALSXP) and length n
+// which takes ownership of the malloc'd buffer *data. *data is set to null
+// as soon as R owns the buffer, so the caller must not free it afterwards.
+extern "C" SEXP luajr_altrep_vector(void** data, double n, int rtype)
+{
+    R_altrep_class_t cls;
+    switch (rtype)
+    {
+        case REALSXP: cls = luajr_altreal;    break;
+        case INTSXP:  cls = luajr_altinteger; break;
+        case LGLSXP:  cls = luajr_altlogical; break;
+        default: Rf_error("luajr_altrep_vector: unsupported type %s", Rf_type2char(rtype));
+    }
+
+    // Empty vectors are not worth wrapping
+    if (n <= 0 || *data == 0)
+    {
+        std::free(*data);
+        *data = 0;
+        return Rf_allocVector(rtype, 0);
+    }
+
+    // Transfer ownership of the buffer to the external pointer
+    SEXP ptr = PROTECT(R_MakeExternalPtr(*data, R_NilValue, R_NilValue));
+    R_RegisterCFinalizerEx(ptr, altrep_finalize, TRUE);
+    *data = 0;
+
+    SEXP len = PROTECT(Rf_ScalarReal(n));
+    SEXP ret = R_new_altrep(cls, ptr, len);
+    UNPROTECT(2);
+    return ret;
+}
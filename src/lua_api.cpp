@@ -3,6 +3,9 @@
 #include "shared.h"
 #include <vector>
 #include <iostream>
+#include <atomic>
+#include <mutex>
+#include <thread>
 extern "C" {
 #include "lua.h"
 }
@@ -10,18 +13,9 @@ extern "C" {
 #include <R.h>
 #include <Rinternals.h>
 #include <R_ext/Altrep.h>
+#include <Rversion.h>
 
-// Reference types
-typedef struct { int* _p;    SEXP _s; } logical_rt;
-typedef struct { int* _p;    SEXP _s; } integer_rt;
-typedef struct { double* _p; SEXP _s; } numeric_rt;
-typedef struct { SEXP _s; } character_rt;
-
-// Vector types
-typedef struct { int* p;    double n; double c; } logical_vt;
-typedef struct { int* p;    double n; double c; } integer_vt;
-typedef struct { double* p; double n; double c; } numeric_vt;
-// Character vector is defined in luajr.lua as a table
+// Reference types and vector types are defined in shared.h
 
 // NA definitions
 int TRUE_logical = 1;
@@ -91,6 +85,46 @@ extern "C" void SetCharacterRef(character_rt* x, SEXP s)
     x->_s = s;
 }
 
+// Dimensions of s; a vector without a dim attribute of length 2 is taken to
+// be a single column
+static void matrix_dims(SEXP s, int* nrow, int* ncol)
+{
+    SEXP dim = Rf_getAttrib(s, R_DimSymbol);
+    if (TYPEOF(dim) == INTSXP && Rf_length(dim) == 2)
+    {
+        *nrow = INTEGER(dim)[0];
+        *ncol = INTEGER(dim)[1];
+    }
+    else
+    {
+        *nrow = Rf_length(s);
+        *ncol = 1;
+    }
+}
+
+// For matrix reference types, _p is offset so that element (i, j) (1-based)
+// is _p[i + j * nrow]
+extern "C" void SetLogicalMatrixRef(logical_matrix_rt* x, SEXP s)
+{
+    matrix_dims(s, &x->nrow, &x->ncol);
+    x->_p = LOGICAL(s) - 1 - x->nrow;
+    x->_s = s;
+}
+
+extern "C" void SetIntegerMatrixRef(integer_matrix_rt* x, SEXP s)
+{
+    matrix_dims(s, &x->nrow, &x->ncol);
+    x->_p = INTEGER(s) - 1 - x->nrow;
+    x->_s = s;
+}
+
+extern "C" void SetNumericMatrixRef(numeric_matrix_rt* x, SEXP s)
+{
+    matrix_dims(s, &x->nrow, &x->ncol);
+    x->_p = REAL(s) - 1 - x->nrow;
+    x->_s = s;
+}
+
 extern "C" void AllocLogical(logical_rt* x, ptrdiff_t size)
 {
     x->_s = Rf_allocVector(LGLSXP, size);
@@ -127,6 +161,27 @@ extern "C" void AllocNumeric(numeric_rt* x, ptrdiff_t size)
     x->_p = REAL(x->_s) - 1;
 }
 
+extern "C" void AllocLogicalMatrix(logical_matrix_rt* x, int nrow, int ncol)
+{
+    x->_s = Rf_allocMatrix(LGLSXP, nrow, ncol);
+    R_PreserveObject(x->_s);
+    SetLogicalMatrixRef(x, x->_s);
+}
+
+extern "C" void AllocIntegerMatrix(integer_matrix_rt* x, int nrow, int ncol)
+{
+    x->_s = Rf_allocMatrix(INTSXP, nrow, ncol);
+    R_PreserveObject(x->_s);
+    SetIntegerMatrixRef(x, x->_s);
+}
+
+extern "C" void AllocNumericMatrix(numeric_matrix_rt* x, int nrow, int ncol)
+{
+    x->_s = Rf_allocMatrix(REALSXP, nrow, ncol);
+    R_PreserveObject(x->_s);
+    SetNumericMatrixRef(x, x->_s);
+}
+
 extern "C" void AllocCharacter(character_rt* x, ptrdiff_t size)
 {
     x->_s = Rf_allocVector(STRSXP, size);
@@ -151,11 +206,63 @@ extern "C" void AllocCharacterTo(character_rt* x, ptrdiff_t size, const char* v)
     UNPROTECT(1);
 }
 
-extern "C" void Release(SEXP s)
+// R objects released by Lua code outside of the main thread, for instance
+// when a shared vector is garbage collected in a lua_parallel worker. The R
+// API can only be used from the main thread, so these are queued up here
+// and released by luajr_release_pending(). The flag is whether the object is
+// the holder of a shared vector (see ShareLogicalVec).
+static const std::thread::id main_thread = std::this_thread::get_id();
+static std::mutex release_mutex;
+static std::vector<std::pair<SEXP, bool>> release_queue;
+static std::atomic<bool> release_queued { false };
+
+// Release s, first letting go of the shared vector if s is a holder.
+static void release_object(SEXP s, bool holder)
 {
+    if (holder)
+        SET_VECTOR_ELT(s, 0, R_NilValue);
     R_ReleaseObject(s);
 }
 
+// Release s now if in the main thread, otherwise queue it for release.
+static void release_or_queue(SEXP s, bool holder)
+{
+    if (std::this_thread::get_id() != main_thread)
+    {
+        std::lock_guard<std::mutex> lock { release_mutex };
+        release_queue.emplace_back(s, holder);
+        release_queued = true;
+        return;
+    }
+    release_object(s, holder);
+    if (release_queued)
+        luajr_release_pending();
+}
+
+// Release any R objects queued up by other threads. Must be called from the
+// main thread.
+extern "C" void luajr_release_pending()
+{
+    std::vector<std::pair<SEXP, bool>> q;
+    {
+        std::lock_guard<std::mutex> lock { release_mutex };
+        q.swap(release_queue);
+        release_queued = false;
+    }
+    for (auto& r : q)
+        release_object(r.first, r.second);
+}
+
+extern "C" void Release(SEXP s)
+{
+    release_or_queue(s, false);
+}
+
+extern "C" void ReleaseShared(SEXP s)
+{
+    release_or_queue(s, true);
+}
+
 extern "C" void SetLogicalVec(logical_vt* x, SEXP s)
 {
     std::memcpy(x->p + 1, LOGICAL(s), sizeof(int) * Rf_xlength(s));
@@ -171,6 +278,72 @@ extern "C" void SetNumericVec(numeric_vt* x, SEXP s)
     std::memcpy(x->p + 1, REAL(s), sizeof(double) * Rf_xlength(s));
 }
 
+// The Share*Vec functions make x share the memory of s until x is modified
+// (see vec_own in luajr.lua). x->_s is a preserved list holding s, which
+// x releases with ReleaseShared. As the list adds to the reference count of
+// s, R copies s rather than modifying it in place while x shares it, without
+// s having to be marked as not mutable for good. Before R 4.0.0, which has no
+// reference counting, s is marked as not mutable instead.
+static SEXP make_share_holder(void* data)
+{
+    SEXP s = reinterpret_cast<SEXP>(data);
+#if R_VERSION < R_Version(4, 0, 0)
+    MARK_NOT_MUTABLE(s);
+#endif
+    SEXP holder = PROTECT(Rf_allocVector(VECSXP, 1));
+    SET_VECTOR_ELT(holder, 0, s);
+    R_PreserveObject(holder);
+    UNPROTECT(1);
+    return holder;
+}
+
+static SEXP no_share_holder(SEXP, void*)
+{
+    return R_NilValue;
+}
+
+// As the Share*Vec functions are called from Lua, an R error must not jump
+// out of them; if the holder cannot be made, they return 0 instead, and the
+// vector is copied (see luajr.construct_vec). s must not be an ALTREP vector
+// whose data are not yet materialised.
+static SEXP share_holder(SEXP s)
+{
+    return R_tryCatchError(make_share_holder, s, no_share_holder, 0);
+}
+
+extern "C" int ShareLogicalVec(logical_vt* x, SEXP s)
+{
+    SEXP holder = share_holder(s);
+    if (holder == R_NilValue)
+        return 0;
+    x->_s = holder;
+    x->p = LOGICAL(s) - 1;
+    x->n = x->c = Rf_xlength(s);
+    return 1;
+}
+
+extern "C" int ShareIntegerVec(integer_vt* x, SEXP s)
+{
+    SEXP holder = share_holder(s);
+    if (holder == R_NilValue)
+        return 0;
+    x->_s = holder;
+    x->p = INTEGER(s) - 1;
+    x->n = x->c = Rf_xlength(s);
+    return 1;
+}
+
+extern "C" int ShareNumericVec(numeric_vt* x, SEXP s)
+{
+    SEXP holder = share_holder(s);
+    if (holder == R_NilValue)
+        return 0;
+    x->_s = holder;
+    x->p = REAL(s) - 1;
+    x->n = x->c = Rf_xlength(s);
+    return 1;
+}
+
 extern "C" int GetAttrType(SEXP s, const char* k)
 {
     SEXP a = Rf_getAttrib(s, Rf_install(k));
@@ -1,14 +1,26 @@
 // parallel.cpp: Run Lua code in parallel
 
 #include "shared.h"
+#include "registry_entry.h"
+#include <algorithm>
 #include <atomic>
+#include <climits>
 #include <chrono>
+#include <cmath>
+#include <condition_variable>
+#include <cstring>
+#include <functional>
 #include <iomanip>
 #include <iostream>
+#include <memory>
 #include <mutex>
 #include <string>
 #include <thread>
 #include <vector>
+#ifdef __linux__
+#include <pthread.h>
+#include <sched.h>
+#endif
 extern "C" {
 #include "lua.h"
 #include "lauxlib.h"
@@ -17,222 +29,1858 @@ extern "C" {
 #include <R.h>
 #include <Rinternals.h>
 
-// Open [threads] new Lua states (or use [threads] if a list of states), run
-// code [pre] in each one, then run "return [func]" to get a function. Call the
-// func(i) with i in 1 to n.
-extern "C" SEXP luajr_run_parallel(SEXP func, SEXP n, SEXP threads, SEXP pre)
+// Registry key for each state's cache of compiled "return [func]" chunks
+static int luajr_parallel_chunks = 0;
+
+// Restrict the calling thread to the CPUs numbered in [cpus], returning false
+// if this fails or is not supported on this platform.
+static bool pin_thread(const std::vector<int>& cpus)
+{
+#ifdef __linux__
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    for (unsigned int i = 0; i < cpus.size(); ++i)
+        if (cpus[i] < CPU_SETSIZE)
+            CPU_SET(cpus[i], &set);
+    return pthread_setaffinity_np(pthread_self(), sizeof(set), &set) == 0;
+#else
+    (void)cpus;
+    return false;
+#endif
+}
+
+// A pool of worker threads, each with its own Lua state, which persist across
+// calls to lua_parallel. Between jobs, the workers wait on a condition
+// variable; LuaPool::Run hands the same task to every worker and waits for all
+// of them to finish it.
+class LuaPool
+{
+public:
+    typedef std::function<void(unsigned int)> Task;
+
+    // Start n worker threads, each of which opens its own Lua state (all at
+    // the same time), and wait until all the states are ready. If [affinity]
+    // is not empty, worker t is first pinned to the CPUs in
+    // affinity[t % affinity.size()]. If a state could not be opened, the
+    // error is left in open_error, and the pool should be deleted.
+    LuaPool(unsigned int n, const std::vector<std::vector<int>>& affinity)
+     : states(n, 0), pending(n)
+    {
+        for (unsigned int t = 0; t < n; ++t)
+            workers.emplace_back(&LuaPool::Loop, this, t,
+                affinity.empty() ? std::vector<int>() : affinity[t % affinity.size()]);
+        Wait();
+    }
+
+    // Stop the worker threads and close the Lua states.
+    ~LuaPool()
+    {
+        {
+            std::lock_guard<std::mutex> lock { m };
+            stop = true;
+        }
+        cv_start.notify_all();
+        for (unsigned int t = 0; t < workers.size(); ++t)
+            workers[t].join();
+        for (unsigned int t = 0; t < states.size(); ++t)
+        {
+            if (!states[t])
+                continue;
+            luajr_tooling_cleanup(states[t]);
+            RegistryEntry::DisarmAll(states[t]);
+            lua_close(states[t]);
+        }
+    }
+
+    LuaPool(const LuaPool&) = delete;
+    LuaPool& operator=(const LuaPool&) = delete;
+
+    // Run task(t) in worker thread t for each worker, and wait for all to
+    // finish.
+    void Run(const Task& f)
+    {
+        Start(f);
+        Wait();
+    }
+
+    // Start running task(t) in worker thread t for each worker, without
+    // waiting for them to finish. f must remain valid until Wait() returns.
+    void Start(const Task& f)
+    {
+        std::unique_lock<std::mutex> lock { m };
+        cv_done.wait(lock, [this] { return pending == 0; });
+        task = &f;
+        pending = workers.size();
+        ++generation;
+        cv_start.notify_all();
+    }
+
+    // Wait for all workers to finish the task given to Start().
+    void Wait()
+    {
+        std::unique_lock<std::mutex> lock { m };
+        cv_done.wait(lock, [this] { return pending == 0; });
+        task = 0;
+    }
+
+    // The Lua state of each worker.
+    std::vector<lua_State*> states;
+
+    // Whether the pool is running an asynchronous lua_parallel job. Only
+    // accessed from the main thread.
+    bool busy = false;
+
+    // Whether any worker could not be pinned to its CPUs.
+    std::atomic<bool> pin_failed { false };
+
+    // Error from opening a worker's Lua state, if any.
+    std::string open_error;
+
+private:
+    // Worker thread t: pin the thread to [cpus], if any, and open its Lua
+    // state, so that the state's memory is first touched by (and, on NUMA
+    // systems, allocated close to) the thread which will use it. Then wait
+    // for each new task and run it.
+    void Loop(unsigned int t, std::vector<int> cpus)
+    {
+        if (!cpus.empty() && !pin_thread(cpus))
+            pin_failed = true;
+        char buf[1024];
+        lua_State* L = luajr_trynewstate(buf);
+
+        unsigned long seen = 0;
+        std::unique_lock<std::mutex> lock { m };
+        states[t] = L;
+        if (!L && open_error.empty())
+            open_error = buf;
+        if (--pending == 0)
+            cv_done.notify_all();
+        for (;;)
+        {
+            cv_start.wait(lock, [&] { return stop || generation != seen; });
+            if (stop)
+                return;
+            seen = generation;
+            const Task* f = task;
+            lock.unlock();
+            (*f)(t);
+            lock.lock();
+            if (--pending == 0)
+                cv_done.notify_all();
+        }
+    }
+
+    std::vector<std::thread> workers;
+    std::mutex m;
+    std::condition_variable cv_start;
+    std::condition_variable cv_done;
+    const Task* task = 0;
+    unsigned long generation = 0;
+    unsigned int pending = 0;
+    bool stop = false;
+};
+
+// Destroy a LuaPool pointed to by an R external pointer when it is no longer
+// needed (i.e. at program exit or garbage collection of the R pointer).
+static void finalize_lua_pool(SEXP xptr)
+{
+    delete reinterpret_cast<LuaPool*>(R_ExternalPtrAddr(xptr));
+    R_ClearExternalPtr(xptr);
+}
+
+// Run code [pre] in Lua state L, returning any error message rather than
+// raising an R error, as this may be called from a worker thread.
+static std::string run_pre(lua_State* L, const char* pre_code, int tflags)
+{
+    char buf[1024] = "";
+    int err = luaL_loadstring(L, pre_code);
+    if (!err)
+        err = luajr_pcall(L, 0, 0, 0, tflags); // Discard any return values
+    if (err)
+        luajr_handle_lua_error(L, err, "lua_parallel 'pre' execution", buf);
+    return buf;
+}
+
+// Open a pool of [n] worker threads with a Lua state each, and run code [pre]
+// in each one. [affinity] is NULL or a list of integer vectors of CPU numbers
+// to pin the threads to in turn.
+extern "C" SEXP luajr_pool_create(SEXP n, SEXP pre, SEXP affinity)
 {
-    CheckSEXPLen(func, STRSXP, 1);
     CheckSEXPLen(n, INTSXP, 1);
     CheckSEXPLen(pre, STRSXP, 1);
 
-    // For any call to luajr_pcall
-    static const int tflags = LUAJR_NO_PROFILE_COLLECT | LUAJR_NO_ERROR_HANDLING | LUAJR_TOOLING_ALL;
+    static const int tflags = LUAJR_NO_PROFILE_COLLECT | LUAJR_NO_ERROR_HANDLING;
 
-    // Ensure n is sensible
-    int n_iter = INTEGER(n)[0];
-    if (n_iter < 0) // also covers NA_INTEGER
-        Rf_error("Invalid number of iterations.");
+    int n_threads = INTEGER(n)[0];
+    if (n_threads <= 0) // also covers NA_INTEGER
+        Rf_error("Invalid number of threads.");
 
-    // Don't multi-thread in debug mode
-    bool single_thread = false;
-    if (luajr_debug_mode())
+    // Get CPUs for each thread
+    std::vector<std::vector<int>> cpus;
+    if (affinity != R_NilValue)
     {
-        single_thread = true;
-        Rf_warningcall_immediate(R_NilValue, "luajr debugger is active, so lua_parallel will only use one thread.");
+        if (TYPEOF(affinity) != VECSXP || Rf_length(affinity) == 0)
+            Rf_error("affinity must be NULL or a list of integer vectors.");
+        for (int a = 0; a < Rf_length(affinity); ++a)
+        {
+            SEXP x = VECTOR_ELT(affinity, a);
+            if (TYPEOF(x) != INTSXP || Rf_length(x) == 0)
+                Rf_error("affinity must be NULL or a list of integer vectors.");
+            cpus.emplace_back(INTEGER(x), INTEGER(x) + Rf_length(x));
+            for (unsigned int i = 0; i < cpus.back().size(); ++i)
+                if (cpus.back()[i] < 0) // also covers NA_INTEGER
+                    Rf_error("Invalid CPU number in affinity.");
+        }
     }
-    else if (luajr_profile_mode())
+
+    LuaPool* pool = new LuaPool(n_threads, cpus);
+    if (!pool->open_error.empty())
     {
-        single_thread = true;
-        Rf_warningcall_immediate(R_NilValue, "luajr profiler is active, so lua_parallel will only use one thread.");
+        std::string error_msg = pool->open_error;
+        delete pool;
+        Rf_error("%s", error_msg.c_str());
     }
 
-    // Create or get Lua states for each thread
-    std::vector<lua_State*> l;
-    if (TYPEOF(threads) == INTSXP && Rf_length(threads) == 1)
+    if (STRING_ELT(pre, 0) != NA_STRING)
     {
-        int n_threads = single_thread ? 1 : INTEGER(threads)[0];
-        if (n_threads <= 0) // also covers NA_INTEGER
-            Rf_error("Invalid number of threads.");
-        l.assign(n_threads, 0);
-        for (unsigned int t = 0; t < l.size(); ++t)
-            l[t] = luajr_newstate();
+        const char* pre_code = CHAR(STRING_ELT(pre, 0));
+        std::string error_msg;
+        std::mutex pm;
+        pool->Run([&](unsigned int t) {
+            std::string err = run_pre(pool->states[t], pre_code, tflags);
+            std::lock_guard<std::mutex> lock { pm };
+            if (!err.empty())
+                error_msg = err;
+        });
+
+        if (!error_msg.empty())
+        {
+            delete pool;
+            Rf_error("%s", error_msg.c_str());
+        }
     }
-    else if (TYPEOF(threads) == VECSXP && Rf_length(threads) > 0)
+
+    SEXP ret = PROTECT(luajr_makepointer(pool, LUAJR_POOL_CODE, finalize_lua_pool));
+    if (pool->pin_failed)
+        Rf_warning("Could not set the CPU affinity of the Lua pool's threads.");
+    UNPROTECT(1);
+    return ret;
+}
+
+// Push the function "return [cmd]" compiled in state L, caching the compiled
+// chunk in the registry so that repeated calls with a persistent state (e.g.
+// from a pool) do not recompile it.
+static int load_func_chunk(lua_State* L, const std::string& cmd)
+{
+    lua_pushlightuserdata(L, (void*)&luajr_parallel_chunks);
+    lua_rawget(L, LUA_REGISTRYINDEX);
+    if (lua_isnil(L, -1))
     {
-        l.assign(single_thread ? 1 : Rf_length(threads), 0);
+        lua_pop(L, 1);
+        lua_newtable(L);
+        lua_pushlightuserdata(L, (void*)&luajr_parallel_chunks);
+        lua_pushvalue(L, -2);
+        lua_rawset(L, LUA_REGISTRYINDEX);
+    }
+
+    lua_pushlstring(L, cmd.data(), cmd.size());
+    lua_rawget(L, -2);
+    if (lua_isfunction(L, -1))
+    {
+        lua_remove(L, -2); // cache
+        return 0;
+    }
+    lua_pop(L, 1);
+
+    int err = luaL_loadbuffer(L, cmd.data(), cmd.size(), cmd.c_str());
+    if (!err)
+    {
+        lua_pushlstring(L, cmd.data(), cmd.size());
+        lua_pushvalue(L, -2);
+        lua_rawset(L, -4);
+    }
+    lua_remove(L, -2); // cache
+    return err;
+}
+
+// Hands out ranges of iterations [first, last] within 1 to n to each of
+// nthreads threads, like the schedule clause of OpenMP. With STATIC, thread t
+// gets a fixed share of the iterations, either one contiguous block each or,
+// if chunk > 0, every nthreads-th block of chunk iterations starting at block
+// t. With DYNAMIC, threads take the next chunk iterations from a shared
+// counter as they go. With GUIDED, threads take a share of the remaining
+// iterations proportional to 1/nthreads, but no fewer than chunk. With
+// STEALING, each thread starts with one contiguous block and takes chunk
+// iterations at a time from the front of it; a thread whose block is empty
+// steals the back half of the largest remaining block of another thread.
+class Schedule
+{
+public:
+    enum Kind { STATIC, DYNAMIC, GUIDED, STEALING };
+
+    Schedule(Kind k, int n_iter, int chunk_size, unsigned int n_threads)
+     : kind(k), n(n_iter), chunk(chunk_size), nthreads(n_threads), next(1)
+    {
+        if (chunk <= 0 && kind != STATIC)
+            chunk = 1;
+        if (kind == STEALING)
+        {
+            blocks = std::vector<Block>(nthreads);
+            for (unsigned int t = 0; t < nthreads; ++t)
+                blocks[t].range = pack((long long)n * t / nthreads + 1,
+                    (long long)n * (t + 1) / nthreads);
+        }
+    }
+
+    // Get the next range for thread t in [first, last], returning false if
+    // there are none left. cursor is thread-local, and should start at 0.
+    bool Next(unsigned int t, int& cursor, int& first, int& last)
+    {
+        switch (kind)
+        {
+            case STATIC:
+                if (chunk <= 0)
+                {
+                    // One contiguous block per thread
+                    if (cursor++ > 0)
+                        return false;
+                    first = (long long)n * t / nthreads + 1;
+                    last = (long long)n * (t + 1) / nthreads;
+                }
+                else
+                {
+                    // Round-robin blocks of size chunk
+                    long long block = (long long)cursor++ * nthreads + t;
+                    if (block * chunk >= n)
+                        return false;
+                    first = block * chunk + 1;
+                    last = std::min<long long>(first + chunk - 1, n);
+                }
+                break;
+
+            case DYNAMIC:
+                first = next.fetch_add(chunk);
+                if (first > n || first <= 0) // <= 0 on overflow
+                    return false;
+                last = std::min<long long>((long long)first + chunk - 1, n);
+                break;
+
+            case GUIDED:
+                first = next.load();
+                do {
+                    if (first > n)
+                        return false;
+                    last = first + std::max<int>(chunk, (n - first + 1) / nthreads) - 1;
+                    last = std::min(last, n);
+                } while (!next.compare_exchange_weak(first, last + 1));
+                break;
+
+            case STEALING:
+                while (!Take(t, first, last))
+                    if (!Steal(t))
+                        return false;
+                break;
+        }
+        return first <= last;
+    }
+
+private:
+    // The remaining iterations [lo, hi] of one thread for STEALING, packed
+    // into one word so that the owner and thieves can update it atomically.
+    // Each is on its own cache line to avoid false sharing.
+    struct alignas(64) Block
+    {
+        std::atomic<unsigned long long> range { 0 };
+    };
+
+    static unsigned long long pack(unsigned int lo, unsigned int hi)
+    {
+        return (unsigned long long)hi << 32 | lo;
+    }
+
+    static void unpack(unsigned long long r, int& lo, int& hi)
+    {
+        lo = (int)(r & 0xFFFFFFFFull);
+        hi = (int)(r >> 32);
+    }
+
+    // Take up to chunk iterations from the front of thread t's own block.
+    bool Take(unsigned int t, int& first, int& last)
+    {
+        unsigned long long r = blocks[t].range.load();
+        int lo, hi;
+        do {
+            unpack(r, lo, hi);
+            if (lo > hi)
+                return false;
+            first = lo;
+            last = std::min<long long>((long long)lo + chunk - 1, hi);
+        } while (!blocks[t].range.compare_exchange_weak(r, pack(last + 1, hi)));
+        return true;
+    }
+
+    // Steal the back half of the largest other block into thread t's block,
+    // returning false if there are no iterations left to steal.
+    bool Steal(unsigned int t)
+    {
+        for (;;)
+        {
+            // Find the victim with the most iterations remaining
+            unsigned int victim = t;
+            unsigned long long vr = 0;
+            int most = 0;
+            for (unsigned int u = 0; u < nthreads; ++u)
+            {
+                if (u == t)
+                    continue;
+                unsigned long long r = blocks[u].range.load();
+                int lo, hi;
+                unpack(r, lo, hi);
+                if (hi - lo + 1 > most)
+                {
+                    most = hi - lo + 1;
+                    victim = u;
+                    vr = r;
+                }
+            }
+            if (victim == t)
+                return false;
+
+            // Split the victim's block, leaving it the front half
+            int lo, hi;
+            unpack(vr, lo, hi);
+            int mid = lo + most / 2;
+            if (blocks[victim].range.compare_exchange_strong(vr, pack(lo, mid - 1)))
+            {
+                blocks[t].range.store(pack(mid, hi));
+                return true;
+            }
+        }
+    }
+
+    Kind kind;
+    int n;
+    int chunk;
+    unsigned int nthreads;
+    std::atomic<int> next;
+    std::vector<Block> blocks;
+};
+
+// Preallocated result for lua_parallel with FUN.VALUE: a logical, integer or
+// numeric vector (k = 1) or k x n matrix (k > 1), into which the k values
+// for iteration i are written directly by the worker threads, at elements
+// (i - 1) * k to i * k - 1. Each iteration writes to its own elements, and
+// no R API functions are called, so this is safe from any thread.
+struct TypedResult
+{
+    int type;       // LGLSXP, INTSXP or REALSXP
+    int k;          // Number of values per iteration
+    void* data;     // Pointer to LOGICAL, INTEGER or REAL data of result
+    double na_real; // NA_REAL, read on the main thread
+};
+
+// Write the Lua value at stack index idx to element j of tr, returning
+// false if it is not of a suitable type: a number for REALSXP, a whole
+// number in range for INTSXP (see luajr_tointeger) or a boolean for LGLSXP.
+// nil becomes NA.
+static bool typed_set(lua_State* L, int idx, const TypedResult& tr, R_xlen_t j)
+{
+    int type = lua_type(L, idx);
+    if (type == LUA_TNONE)
+        type = LUA_TNIL;
+    switch (tr.type)
+    {
+        case REALSXP:
+            if (type == LUA_TNUMBER)
+                ((double*)tr.data)[j] = lua_tonumber(L, idx);
+            else if (type == LUA_TNIL)
+                ((double*)tr.data)[j] = tr.na_real;
+            else
+                return false;
+            break;
+
+        case INTSXP:
+            if (type == LUA_TNIL)
+                ((int*)tr.data)[j] = NA_INTEGER;
+            else if (!luajr_tointeger(L, idx, (int*)tr.data + j))
+                return false;
+            break;
+
+        case LGLSXP:
+            if (type == LUA_TBOOLEAN)
+                ((int*)tr.data)[j] = lua_toboolean(L, idx);
+            else if (type == LUA_TNIL)
+                ((int*)tr.data)[j] = NA_LOGICAL;
+            else
+                return false;
+            break;
+    }
+    return true;
+}
+
+// Write the values for iteration i to tr from the nret values starting at
+// stack index base: either k values, or one table of k values, or none (or
+// one nil) for NA. Returns false if the values do not fit.
+static bool typed_store(lua_State* L, int base, int nret, const TypedResult& tr, int i)
+{
+    R_xlen_t j0 = (R_xlen_t)(i - 1) * tr.k;
+
+    if (nret == 0 || (nret == 1 && lua_isnil(L, base)))
+    {
+        for (int m = 0; m < tr.k; ++m)
+            typed_set(L, base, tr, j0 + m); // nil or none, so writes NA
+        return true;
+    }
+
+    if (nret == tr.k)
+    {
+        for (int m = 0; m < tr.k; ++m)
+            if (!typed_set(L, base + m, tr, j0 + m))
+                return false;
+        return true;
+    }
+
+    if (nret == 1 && lua_istable(L, base) && (int)lua_objlen(L, base) == tr.k)
+    {
+        for (int m = 0; m < tr.k; ++m)
+        {
+            lua_rawgeti(L, base, m + 1);
+            bool ok = typed_set(L, lua_gettop(L), tr, j0 + m);
+            lua_pop(L, 1);
+            if (!ok)
+                return false;
+        }
+        return true;
+    }
+
+    return false;
+}
+
+// Error message for values that do not fit FUN.VALUE.
+static std::string typed_error(const TypedResult& tr, int i)
+{
+    return "lua_parallel expects `func' to return " + std::to_string(tr.k) +
+        (tr.type == REALSXP ? " number" : tr.type == INTSXP ? " integer" : " boolean") +
+        (tr.k == 1 ? "" : "s") + " (or nil) for iteration " + std::to_string(i) +
+        ", as given by FUN.VALUE.";
+}
+
+// Reduction for lua_parallel with reduce: one of the built-in numeric
+// operations SUM, MIN or MAX, which are done in C without calling into Lua,
+// or CUSTOM, which calls a Lua function combine(a, b).
+struct Reduction
+{
+    enum Op { NONE, SUM, MIN, MAX, CUSTOM };
+
+    Op op;
+    std::string cmd; // "return [reduce]", for CUSTOM
+
+    // Starting value of the accumulator for a built-in operation.
+    double identity() const
+    {
+        return op == MIN ? HUGE_VAL : op == MAX ? -HUGE_VAL : 0.0;
+    }
+
+    // Combine value v into accumulator a for a built-in operation. NaN (and
+    // hence NA) propagates, as with sum(), min() and max() in R.
+    void combine(double& a, double v) const
+    {
+        if (op == SUM)
+            a += v;
+        else if (std::isnan(a))
+            return;
+        else if (std::isnan(v) || (op == MIN ? v < a : v > a))
+            a = v;
+    }
+};
+
+// Push onto the stack of state to a copy of the value at stack index idx of
+// state from, where the value may be nil, a boolean, a number, a string, or a
+// table of these. Tables are copied recursively, without their metatables.
+// Returns false, pushing nothing, if the value cannot be copied.
+static bool copy_value(lua_State* from, int idx, lua_State* to, int depth = 0)
+{
+    switch (lua_type(from, idx))
+    {
+        case LUA_TNIL:
+            lua_pushnil(to);
+            return true;
+        case LUA_TBOOLEAN:
+            lua_pushboolean(to, lua_toboolean(from, idx));
+            return true;
+        case LUA_TNUMBER:
+            lua_pushnumber(to, lua_tonumber(from, idx));
+            return true;
+        case LUA_TSTRING:
+        {
+            size_t len;
+            const char* str = lua_tolstring(from, idx, &len);
+            lua_pushlstring(to, str, len);
+            return true;
+        }
+        case LUA_TTABLE:
+        {
+            // Also guards against tables which contain themselves
+            if (depth >= 100 || !lua_checkstack(from, 3) || !lua_checkstack(to, 4))
+                return false;
+            if (idx < 0)
+                idx = lua_gettop(from) + idx + 1;
+            lua_createtable(to, lua_objlen(from, idx), 0);
+            lua_pushnil(from);
+            while (lua_next(from, idx) != 0)
+            {
+                int top = lua_gettop(from);
+                if (!copy_value(from, top - 1, to, depth + 1))
+                {
+                    lua_pop(from, 2);
+                    lua_pop(to, 1);
+                    return false;
+                }
+                if (!copy_value(from, top, to, depth + 1))
+                {
+                    lua_pop(from, 2);
+                    lua_pop(to, 2);
+                    return false;
+                }
+                lua_rawset(to, -3);
+                lua_pop(from, 1);
+            }
+            return true;
+        }
+        default:
+            return false;
+    }
+}
+
+// Description of the R object X passed to lua_parallel_map, for creating
+// slices of it in each thread without calling the R API. X is a vector
+// (kind 0), a matrix (kind 1) split into blocks of columns, or a data frame
+// (kind 2) split into blocks of rows. The data pointer and type code
+// (LOGICAL_T, INTEGER_T or NUMERIC_T) are given for each of its columns.
+// x is X itself.
+struct MapSpec
+{
+    int kind;
+    int nrow;
+    std::vector<const void*> ptr;
+    std::vector<int> type;
+    std::vector<std::string> names;
+    SEXP x;
+};
+
+// Number of iterations completed by one worker thread of a ParallelJob. Only
+// the worker itself writes to this, and each is on its own cache line, so it
+// can be updated after every iteration without contention.
+struct alignas(64) Progress
+{
+    std::atomic<long long> done { 0 };
+};
+
+// Stop flag of the ParallelJob whose worker is running in this thread, if any.
+static thread_local const std::atomic<bool>* job_stop = 0;
+
+// Count hook which each worker of a threaded ParallelJob sets in its own
+// state, to interrupt running Lua code once the job has been stopped.
+static void stop_hook(lua_State* L, lua_Debug*)
+{
+    if (job_stop && job_stop->load(std::memory_order_relaxed))
+        luaL_error(L, "lua_parallel was stopped.");
+}
+
+// Check for a user interrupt; for use with R_ToplevelExec, so that an
+// interrupt does not jump out of the caller.
+static void check_interrupt(void*)
+{
+    R_CheckUserInterrupt();
+}
+
+// One call to lua_parallel or lua_parallel_map on the Lua states [l], which
+// is set to work by Start(). If [own] is true, the states are opened by the
+// worker threads themselves, and closed by Finish(). Finished() and Wait()
+// check for or wait for the worker threads to finish, and Finish() gathers
+// the results into an R object and tidies up the states. Work() runs in the
+// worker threads and does not use the R API; everything else runs in the
+// main thread.
+class ParallelJob
+{
+public:
+    ParallelJob(const std::vector<lua_State*>& states, LuaPool* lua_pool,
+        bool own, const std::string& func_cmd, const char* pre,
+        Schedule::Kind kind, int n, int chunk, bool range,
+        const TypedResult& typed_result, SEXP typed_sexp,
+        const Reduction& reduction, const MapSpec* map_spec)
+     : l(states), pool(lua_pool), own_states(own), cmd(func_cmd),
+       has_pre(pre != 0), pre_code(pre ? pre : ""),
+       sched(kind, n, chunk, states.size()), n_iter(n), range_call(range),
+       typed(typed_sexp != R_NilValue), tr(typed_result), result(typed_sexp),
+       red(reduction), reducing(reduction.op != Reduction::NONE),
+       racc(states.size(), reduction.identity()), progress(states.size()),
+       running(states.size())
+    {
+        if (map_spec)
+            map.reset(new MapSpec(*map_spec));
+
+        // Initial stack top of each state, to restore after collecting results
         for (unsigned int t = 0; t < l.size(); ++t)
+            top_start.push_back(l[t] ? lua_gettop(l[t]) : 0);
+    }
+
+    ParallelJob(const ParallelJob&) = delete;
+    ParallelJob& operator=(const ParallelJob&) = delete;
+
+    // Run Work(t) for each thread t, in new threads or in the threads of the
+    // pool, without waiting for them to finish. If [timeout] is finite, also
+    // start a watchdog thread which stops the job after that many seconds.
+    // The exception is when the debugger is on, there is just one thread and
+    // the job is not asynchronous: then Work(0) runs to completion in the
+    // calling thread, as during parallel execution, input from the console is
+    // not available, even if there is only one thread going.
+    void Start(bool async, double timeout)
+    {
+        if (l.size() == 1 && !async && luajr_debug_mode())
         {
-            l[t] = luajr_getstate(VECTOR_ELT(threads, t));
-            for (unsigned int u = 0; u < t; ++u)
-                if (l[u] == l[t])
-                    Rf_error("Cannot use the same Lua state across multiple threads.");
+            RunThread(0);
+            return;
+        }
+
+        threaded = true;
+        interruptible = async || timeout < R_PosInf;
+        task = [this](unsigned int t) { RunThread(t); };
+        if (pool)
+        {
+            pool->Start(task);
+            pool_started = true;
+            if (async)
+                pool->busy = true;
+        }
+        else
+        {
+            for (unsigned int t = 0; t < l.size(); ++t)
+                thr.emplace_back(&ParallelJob::RunThread, this, t);
+        }
+
+        // Stop the main thread from using states that persist after the job
+        // (such as through functions returned by an earlier job) while the
+        // workers are using them.
+        if (!own_states)
+            for (unsigned int t = 0; t < l.size(); ++t)
+                RegistryEntry::SetBusy(l[t], true);
+
+        if (timeout < R_PosInf)
+        {
+            watchdog = std::thread([this, timeout] {
+                if (!Wait(timeout))
+                {
+                    char buf[128];
+                    snprintf(buf, sizeof(buf), "lua_parallel timed out after %g seconds.", timeout);
+                    Fail(buf);
+                }
+            });
         }
     }
-    else
+
+    // Wait for all worker threads to finish, checking regularly for a user
+    // interrupt, which stops the job.
+    void WaitInterruptible()
     {
-        Rf_error("threads parameter must be either an integer or a list of Lua states.");
+        while (!Wait(0.05))
+            if (!R_ToplevelExec(check_interrupt, NULL))
+                Fail("lua_parallel was interrupted.");
     }
 
-    // Assemble statement that returns Lua function
-    std::string cmd = "return ";
-    cmd += CHAR(STRING_ELT(func, 0));
+    // Ask the worker threads to stop as soon as possible.
+    void Cancel()
+    {
+        Fail("lua_parallel was cancelled.");
+    }
 
-    // Get pre-run code
-    const char* pre_code = 0;
-    if (STRING_ELT(pre, 0) != NA_STRING)
-        pre_code = CHAR(STRING_ELT(pre, 0));
+    // Record the error message [msg], unless an error has already been
+    // recorded, and stop the job. Each worker checks the stop flag between
+    // iterations, and its stop hook, if set, checks it while Lua code is
+    // running. This only sets the flag, as the states belong to the worker
+    // threads. May be called from any thread.
+    void Fail(const std::string& msg)
+    {
+        std::lock_guard<std::mutex> lock { pm };
+        if (error_msg.empty())
+            error_msg = msg;
+        stop = true;
+    }
 
-    // The work itself
-    std::atomic<int> iter { 0 };
-    std::string error_msg;
-    std::mutex pm;
-    SEXP result = R_NilValue;
+    // Fail() with the Lua error [err] in state L, from the action [what].
+    void FailLua(lua_State* L, int err, const char* what)
+    {
+        char buf[1024];
+        luajr_handle_lua_error(L, err, what, buf);
+        Fail(buf);
+    }
 
-    auto work = [&](const unsigned int t)
+    // Have all worker threads finished?
+    bool Finished()
     {
-        // Run pre-code
-        if (pre_code != 0)
+        std::lock_guard<std::mutex> lock { jm };
+        return running == 0;
+    }
+
+    // Wait for up to [seconds] for all worker threads to finish, returning
+    // whether they have.
+    bool Wait(double seconds)
+    {
+        std::unique_lock<std::mutex> lock { jm };
+        return cv_finished.wait_for(lock, std::chrono::duration<double>(seconds),
+            [this] { return running == 0; });
+    }
+
+    // The pool used by the job, if any.
+    LuaPool* GetPool() const
+    {
+        return pool;
+    }
+
+    // Number of iterations completed so far.
+    double Done() const
+    {
+        long long done = 0;
+        for (unsigned int t = 0; t < progress.size(); ++t)
+            done += progress[t].done.load(std::memory_order_relaxed);
+        return done;
+    }
+
+    // Error message produced so far, if any.
+    std::string Error()
+    {
+        std::lock_guard<std::mutex> lock { pm };
+        return error_msg;
+    }
+
+    // Wait for the worker threads to finish, then, if [collect] is true,
+    // return the results, or R NULL with the error message in [err] if there
+    // was an error. Also close the states (if lua_parallel created them) or
+    // clear the stack of each state (as these states persist).
+    SEXP Finish(bool collect, std::string& err)
+    {
+        for (unsigned int t = 0; t < thr.size(); ++t)
+            thr[t].join();
+        thr.clear();
+        if (pool_started)
+        {
+            pool->Wait();
+            pool->busy = false;
+            pool_started = false;
+        }
+        if (watchdog.joinable())
+            watchdog.join();
+        if (threaded && !own_states)
+            for (unsigned int t = 0; t < l.size(); ++t)
+                RegistryEntry::SetBusy(l[t], false);
+
+        // Release any R objects let go of by Lua garbage collection in the
+        // worker threads
+        luajr_release_pending();
+
+        if (collect && error_msg.empty() && reducing)
+            MergeReductions();
+
+        // Collect any profiler data
+        for (unsigned int t = 0; t < l.size(); ++t)
+            if (l[t])
+                luajr_profile_collect(l[t]);
+
+        SEXP ret = R_NilValue;
+        int nprotect = 0;
+        if (!collect || !error_msg.empty())
+        {
+            err = error_msg;
+        }
+        else if (red.op == Reduction::CUSTOM)
+        {
+            // Get reduced value
+            lua_pushvalue(l[0], top_start[0] + 4);
+            ret = PROTECT(luajr_return(l[0], 1));
+            ++nprotect;
+        }
+        else if (reducing)
         {
-            int pre_code_error = luaL_loadstring(l[t], pre_code);
-            if (!pre_code_error)
-                pre_code_error = luajr_pcall(l[t], 0, 0, 0, tflags); // Discard any return values
-            if (pre_code_error)
+            ret = PROTECT(Rf_ScalarReal(racc[0]));
+            ++nprotect;
+        }
+        else if (typed)
+        {
+            ret = result;
+        }
+        else
+        {
+            // Assign computed values to list
+            for (unsigned int t = 0; t < l.size(); ++t)
+            {
+                const int vals = top_start[t] + 2, multi = top_start[t] + 3;
+                lua_pushnil(l[t]);
+                while (lua_next(l[t], vals) != 0)
+                {
+                    if (ret == R_NilValue)
+                    {
+                        ret = PROTECT(Rf_allocVector(VECSXP, n_iter));
+                        ++nprotect;
+                    }
+                    int index = lua_tointeger(l[t], -2);
+                    lua_rawgeti(l[t], multi, index);
+                    int nret = lua_isnil(l[t], -1) ? 1 : lua_tointeger(l[t], -1);
+                    lua_pop(l[t], 1);
+                    if (nret == 1)
+                    {
+                        SET_VECTOR_ELT(ret, index - 1, luajr_return(l[t], 1));
+                    }
+                    else
+                    {
+                        // Unpack the table of values
+                        int tbl = lua_gettop(l[t]);
+                        lua_checkstack(l[t], nret);
+                        for (int m = 1; m <= nret; ++m)
+                            lua_rawgeti(l[t], tbl, m);
+                        SET_VECTOR_ELT(ret, index - 1, luajr_return(l[t], nret));
+                        lua_pop(l[t], 1);
+                    }
+                }
+            }
+        }
+
+        if (own_states)
+        {
+            for (unsigned int t = 0; t < l.size(); ++t)
+            {
+                if (!l[t])
+                    continue;
+                RegistryEntry::DisarmAll(l[t]);
+                lua_close(l[t]);
+            }
+        }
+        else
+            for (unsigned int t = 0; t < l.size(); ++t)
+                lua_settop(l[t], top_start[t]);
+
+        UNPROTECT(nprotect);
+        return ret;
+    }
+
+private:
+    // Run Work(t), then mark thread t as finished. The stop hook set by
+    // Work(t), if any, is cleared first.
+    void RunThread(unsigned int t)
+    {
+        Work(t);
+        if (interruptible && l[t])
+        {
+            lua_sethook(l[t], 0, 0, 0);
+            job_stop = 0;
+        }
+        std::lock_guard<std::mutex> lock { jm };
+        if (--running == 0)
+            cv_finished.notify_all();
+    }
+
+    // The work of thread t.
+    void Work(const unsigned int t)
+    {
+        // For any call to luajr_pcall
+        static const int tflags = LUAJR_NO_PROFILE_COLLECT | LUAJR_NO_ERROR_HANDLING | LUAJR_TOOLING_ALL;
+
+        // Open this thread's Lua state, if lua_parallel is creating the
+        // states, so that the threads open their states concurrently.
+        if (own_states)
+        {
+            char buf[1024];
+            lua_State* L = luajr_trynewstate(buf);
+            if (!L)
             {
-                std::lock_guard<std::mutex> lock { pm };
-                error_msg.assign(1024, ' ');
-                luajr_handle_lua_error(l[t], pre_code_error, "lua_parallel 'pre' execution", error_msg.data());
+                Fail(buf);
+                return;
             }
+            l[t] = L;
+            top_start[t] = lua_gettop(L);
+        }
+
+        // For a job which can be cancelled or can time out, set the stop
+        // hook, so that running Lua code is interrupted (checking every 1000
+        // VM instructions, when not compiled) once the job is stopped.
+        // Otherwise, workers only stop between iterations, as a count hook
+        // slows down all interpreted code. RunThread() clears the hook.
+        if (interruptible)
+        {
+            job_stop = &stop;
+            lua_sethook(l[t], stop_hook, LUA_MASKCOUNT, 1000);
+        }
+        if (stop)
+            return;
+
+        // Run pre-code
+        if (has_pre)
+        {
+            std::string err = run_pre(l[t], pre_code.c_str(), tflags);
+            if (!err.empty())
+                Fail(err);
         }
 
         // Has any thread produced an error?
-        if (!error_msg.empty())
+        if (stop)
             return;
 
         // Run command to get function on stack
         int top0 = lua_gettop(l[t]);
-        int err = luaL_loadstring(l[t], cmd.c_str());
+        int err = load_func_chunk(l[t], cmd);
         if (!err)
             err = luajr_pcall(l[t], 0, LUA_MULTRET, 0, tflags);
         int nret = lua_gettop(l[t]) - top0;
 
         // Handle errors
         if (err) {
-            // This and similar mutex locks are used to avoid writing
-            // to error_message in multiple threads simultaneously.
-            std::lock_guard<std::mutex> lock { pm };
-            error_msg.assign(1024, ' ');
-            luajr_handle_lua_error(l[t], err, "lua_parallel 'func' construction", error_msg.data());
+            FailLua(l[t], err, "lua_parallel 'func' construction");
         } else if (nret != 1) {
-            std::lock_guard<std::mutex> lock { pm };
-            error_msg = "lua_parallel expects `func' to evaluate to one value, not " +
-                std::to_string(nret) + ".";
+            Fail("lua_parallel expects `func' to evaluate to one value, not " +
+                std::to_string(nret) + ".");
         } else if (lua_type(l[t], -1) != LUA_TFUNCTION) {
-            std::lock_guard<std::mutex> lock { pm };
-            error_msg = "lua_parallel expects `func' to evaluate to a function, not a " +
-                std::string(lua_typename(l[t], lua_type(l[t], -1))) + ".";
+            Fail("lua_parallel expects `func' to evaluate to a function, not a " +
+                std::string(lua_typename(l[t], lua_type(l[t], -1))) + ".");
+        }
+
+        // For lua_parallel_map, replace the function with a wrapper that
+        // calls it with slices of X (see luajr.map_slicer)
+        if (map && !stop)
+        {
+            lua_State* L = l[t];
+            int ncol = map->ptr.size();
+            lua_pushlightuserdata(L, (void*)&luajr_map_slicer);
+            lua_rawget(L, LUA_REGISTRYINDEX);
+            lua_insert(L, -2);
+            lua_pushinteger(L, map->kind);
+            lua_pushinteger(L, map->nrow);
+            lua_createtable(L, ncol, 0);
+            lua_createtable(L, ncol, 0);
+            lua_createtable(L, ncol, 0);
+            for (int c = 0; c < ncol; ++c)
+            {
+                lua_pushlightuserdata(L, (void*)map->ptr[c]);
+                lua_rawseti(L, -4, c + 1);
+                lua_pushinteger(L, map->type[c]);
+                lua_rawseti(L, -3, c + 1);
+                lua_pushlstring(L, map->names[c].data(), map->names[c].size());
+                lua_rawseti(L, -2, c + 1);
+            }
+            err = luajr_pcall(L, 6, 1, 0, LUAJR_NO_ERROR_HANDLING);
+            if (err)
+                FailLua(L, err, "lua_parallel_map slicing");
         }
 
         // Has any thread produced an error?
-        if (!error_msg.empty())
+        if (stop)
             return;
 
-        // Get new top of stack (i.e. the function)
+        // Get new top of stack (i.e. the function), then push tables for
+        // the values returned from each iteration (vals[i]) and, for
+        // iterations returning more than one value, the number of values
+        // (multi[i]), with vals[i] then a table of the values.
         top0 = lua_gettop(l[t]);
+        lua_newtable(l[t]);
+        lua_newtable(l[t]);
+        const int vals = top0 + 1, multi = top0 + 2;
 
-        // Do calls
-        for (int i = ++iter; i <= n_iter; i = ++iter)
+        // For reductions, push the thread's accumulator (nil until the first
+        // value comes in) and, for a custom reduction, the function
+        // combine(a, b). Built-in reductions accumulate into acc_num.
+        lua_pushnil(l[t]);
+        const int acc = top0 + 3, comb = top0 + 4;
+        double acc_num = red.identity();
+        if (red.op == Reduction::CUSTOM)
         {
-            // Call the function with iteration number as argument
             int top1 = lua_gettop(l[t]);
-            lua_pushvalue(l[t], top0);
-            lua_pushinteger(l[t], i);
-            err = luajr_pcall(l[t], 1, LUA_MULTRET, 0, tflags);
+            err = load_func_chunk(l[t], red.cmd);
+            if (!err)
+                err = luajr_pcall(l[t], 0, LUA_MULTRET, 0, tflags);
+            nret = lua_gettop(l[t]) - top1;
+
+            if (err) {
+                FailLua(l[t], err, "lua_parallel 'reduce' construction");
+            } else if (nret != 1 || lua_type(l[t], -1) != LUA_TFUNCTION) {
+                Fail("lua_parallel expects `reduce' to be \"+\", \"min\", \"max\", "
+                    "or to evaluate to a function.");
+            }
+            if (stop)
+                return;
+        }
+
+        // Fold the value at (positive) stack index idx into the accumulator,
+        // skipping nil, and returning false on error
+        auto accumulate = [&](int idx) -> bool
+        {
+            lua_State* L = l[t];
+            int type = lua_type(L, idx);
+            if (type == LUA_TNIL || type == LUA_TNONE)
+                return true;
+
+            if (red.op != Reduction::CUSTOM)
+            {
+                if (type != LUA_TNUMBER)
+                {
+                    Fail("lua_parallel with a built-in reduce expects `func' to return numbers (or nil), not a " +
+                        std::string(lua_typename(L, type)) + ".");
+                    return false;
+                }
+                red.combine(acc_num, lua_tonumber(L, idx));
+                return true;
+            }
 
-            // Check for errors
+            if (lua_isnil(L, acc))
+            {
+                lua_pushvalue(L, idx);
+                lua_replace(L, acc);
+                return true;
+            }
+            lua_pushvalue(L, comb);
+            lua_pushvalue(L, acc);
+            lua_pushvalue(L, idx);
+            int err = luajr_pcall(L, 2, 1, 0, tflags);
             if (err)
             {
-                std::lock_guard<std::mutex> lock { pm };
-                error_msg.assign(1024, ' ');
-                luajr_handle_lua_error(l[t], err, "lua_parallel 'func' execution", error_msg.data());
+                FailLua(L, err, "lua_parallel 'reduce' execution");
+                return false;
             }
-            if (!error_msg.empty())
-                return;
+            lua_replace(L, acc);
+            return true;
+        };
 
-            // Push number of return values and index for assignment onto the
-            // stack, unless there were no return values at all.
-            nret = lua_gettop(l[t]) - top1;
-            if (nret > 0)
+        // Do calls
+        std::atomic<long long>& done = progress[t].done;
+        int cursor = 0, first, last;
+        while (!stop && sched.Next(t, cursor, first, last))
+        {
+            if (range_call)
             {
-                lua_checkstack(l[t], 4);
-                lua_pushinteger(l[t], nret);
+                // Call the function with the range of iterations as arguments
+                int top1 = lua_gettop(l[t]);
+                lua_pushvalue(l[t], top0);
+                lua_pushinteger(l[t], first);
+                lua_pushinteger(l[t], last);
+                err = luajr_pcall(l[t], 2, 1, 0, tflags);
+
+                // Check for errors
+                if (err)
+                {
+                    FailLua(l[t], err, "lua_parallel 'func' execution");
+                }
+                else if (!lua_isnil(l[t], -1) && !lua_istable(l[t], -1))
+                {
+                    Fail("lua_parallel with range = TRUE expects `func' to return a table or nil, not a " +
+                        std::string(lua_typename(l[t], lua_type(l[t], -1))) + ".");
+                }
+                if (stop)
+                    return;
+
+                // Store the value for each iteration in the range
+                bool nil = lua_isnil(l[t], -1);
+                for (int i = first; i <= last; ++i)
+                {
+                    if (nil)
+                        lua_pushnil(l[t]);
+                    else
+                        lua_rawgeti(l[t], top1 + 1, i - first + 1);
+
+                    if (typed)
+                    {
+                        if (!typed_store(l[t], top1 + 2, 1, tr, i))
+                        {
+                            Fail(typed_error(tr, i));
+                            return;
+                        }
+                        lua_pop(l[t], 1);
+                    }
+                    else if (reducing)
+                    {
+                        if (!accumulate(top1 + 2))
+                            return;
+                        lua_pop(l[t], 1);
+                    }
+                    else if (lua_isnil(l[t], -1))
+                        lua_pop(l[t], 1);
+                    else
+                        lua_rawseti(l[t], vals, i);
+                }
+                lua_settop(l[t], top1);
+                done.store(done.load(std::memory_order_relaxed) + last - first + 1, std::memory_order_relaxed);
+                continue;
+            }
+
+            for (int i = first; i <= last; ++i)
+            {
+                // Call the function with iteration number as argument
+                int top1 = lua_gettop(l[t]);
+                lua_pushvalue(l[t], top0);
                 lua_pushinteger(l[t], i);
+                err = luajr_pcall(l[t], 1, LUA_MULTRET, 0, tflags);
+
+                // Check for errors
+                if (err)
+                    FailLua(l[t], err, "lua_parallel 'func' execution");
+                if (stop)
+                    return;
+
+                nret = lua_gettop(l[t]) - top1;
+                done.store(done.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+
+                // Write typed results
+                if (typed)
+                {
+                    if (!typed_store(l[t], top1 + 1, nret, tr, i))
+                    {
+                        Fail(typed_error(tr, i));
+                        return;
+                    }
+                    lua_settop(l[t], top1);
+                    continue;
+                }
+
+                // Fold the first returned value into the accumulator
+                if (reducing)
+                {
+                    if (nret > 0 && !accumulate(top1 + 1))
+                        return;
+                    lua_settop(l[t], top1);
+                    continue;
+                }
+
+                // Store returned values, unless there were none (or just nil)
+                if (nret == 1 && !lua_isnil(l[t], -1))
+                {
+                    lua_rawseti(l[t], vals, i);
+                }
+                else if (nret > 1)
+                {
+                    lua_checkstack(l[t], 2);
+                    lua_createtable(l[t], nret, 0);
+                    lua_insert(l[t], top1 + 1);
+                    for (int m = nret; m >= 1; --m)
+                        lua_rawseti(l[t], top1 + 1, m);
+                    lua_rawseti(l[t], vals, i);
+                    lua_pushinteger(l[t], nret);
+                    lua_rawseti(l[t], multi, i);
+                }
+                lua_settop(l[t], top1);
+
+                if (i < last && stop)
+                    return;
             }
         }
-    };
 
-    // During parallel execution, it seems that input from the console is
-    // not available, even if there is only one thread going. So, don't drop
-    // into parallel execution if the number of threads is just one.
-    // (This allows the debugger to carry on working.)
-    if (l.size() > 1)
+        racc[t] = acc_num;
+    }
+
+    // Merge the accumulators of each thread pairwise in a tree, so that the
+    // accumulator of thread 0 ends up holding the combined value. A custom
+    // reduction calls combine(a, b) in the state of thread t, with b copied
+    // over from the state of thread t + s.
+    void MergeReductions()
     {
-        // Create and assign work to the threads
-        std::vector<std::thread> thr;
-        for (unsigned int t = 0; t < l.size(); ++t)
-            thr.emplace_back(work, t);
+        static const int tflags = LUAJR_NO_PROFILE_COLLECT | LUAJR_NO_ERROR_HANDLING | LUAJR_TOOLING_ALL;
 
-        // Wait for threads to finish
-        for (unsigned int t = 0; t < thr.size(); ++t)
-            thr[t].join();
+        for (unsigned int s = 1; error_msg.empty() && s < l.size(); s *= 2)
+        {
+            for (unsigned int t = 0; t + s < l.size() && error_msg.empty(); t += 2 * s)
+            {
+                if (red.op != Reduction::CUSTOM)
+                {
+                    red.combine(racc[t], racc[t + s]);
+                    continue;
+                }
+
+                lua_State* L = l[t];
+                const int acc = top_start[t] + 4, comb = top_start[t] + 5;
+                const int acc_other = top_start[t + s] + 4;
+                if (lua_isnil(l[t + s], acc_other))
+                    continue;
+                bool first = lua_isnil(L, acc);
+                if (!first)
+                {
+                    lua_pushvalue(L, comb);
+                    lua_pushvalue(L, acc);
+                }
+                if (!copy_value(l[t + s], acc_other, L))
+                {
+                    error_msg = "lua_parallel can only combine reduce accumulators which are "
+                        "numbers, strings, booleans, or tables of these.";
+                    break;
+                }
+                if (first)
+                {
+                    lua_replace(L, acc);
+                    continue;
+                }
+                int err = luajr_pcall(L, 2, 1, 0, tflags);
+                if (err)
+                {
+                    char buf[1024];
+                    luajr_handle_lua_error(L, err, "lua_parallel 'reduce' execution", buf);
+                    error_msg = buf;
+                    break;
+                }
+                lua_replace(L, acc);
+            }
+        }
+    }
+
+    std::vector<lua_State*> l;
+    LuaPool* pool;
+    bool own_states;
+    std::vector<int> top_start;
+    std::string cmd;
+    bool has_pre;
+    std::string pre_code;
+    Schedule sched;
+    int n_iter;
+    bool range_call;
+    bool typed;
+    TypedResult tr;
+    SEXP result;
+    Reduction red;
+    bool reducing;
+    std::unique_ptr<MapSpec> map;
+    std::string error_msg;
+    std::mutex pm;
+    std::vector<double> racc;
+    std::vector<Progress> progress;
+    std::atomic<bool> stop { false };
+    bool threaded = false;
+    bool interruptible = false;
+    LuaPool::Task task;
+    bool pool_started = false;
+    std::vector<std::thread> thr;
+    std::thread watchdog;
+    std::mutex jm;
+    std::condition_variable cv_finished;
+    unsigned int running;
+};
+
+// An asynchronous lua_parallel job, as returned to R. Once the job has
+// finished and its results have been collected by lua_wait, the job is
+// deleted and the results (or error message) are kept here.
+struct AsyncJob
+{
+    ParallelJob* job;
+    SEXP keep;          // R objects used by job, preserved while it runs
+    SEXP value;         // Results once collected, preserved
+    std::string error;  // Error message once collected
+    int n;              // Number of iterations
+};
+
+// Arguments for collect_body()
+struct CollectJob
+{
+    ParallelJob* job;
+    std::string err;
+    bool r_error;
+};
+
+static SEXP collect_body(void* data)
+{
+    CollectJob* cj = reinterpret_cast<CollectJob*>(data);
+    return cj->job->Finish(true, cj->err);
+}
+
+// Save the message of an R error raised while collecting a job's results.
+static SEXP collect_handler(SEXP cond, void* data)
+{
+    CollectJob* cj = reinterpret_cast<CollectJob*>(data);
+    std::string& err = cj->err;
+    cj->r_error = true;
+    err = "lua_parallel could not return the results of the job.";
+    if (TYPEOF(cond) == VECSXP && Rf_length(cond) > 0 &&
+        TYPEOF(VECTOR_ELT(cond, 0)) == STRSXP && Rf_length(VECTOR_ELT(cond, 0)) > 0)
+        err = CHAR(STRING_ELT(VECTOR_ELT(cond, 0), 0));
+    return R_NilValue;
+}
+
+// Collect the results of a finished asynchronous job. This is only done once:
+// an R error while returning the results (e.g. a value which cannot be
+// converted) is caught and kept as the job's error, after the job is tidied
+// up, so that it is not collected again (and its reductions merged twice).
+static void collect_async_job(AsyncJob* aj)
+{
+    CollectJob cj = { aj->job, "", false };
+    SEXP value = PROTECT(R_tryCatchError(collect_body, &cj, collect_handler, &cj));
+    std::string err = cj.err;
+    if (cj.r_error)
+    {
+        // Finish() may have stopped part way through; this tidies up the
+        // states without collecting anything
+        std::string ignored;
+        aj->job->Finish(false, ignored);
+    }
+    delete aj->job;
+    aj->job = 0;
+    R_ReleaseObject(aj->keep);
+    aj->keep = R_NilValue;
+    if (err.empty())
+    {
+        R_PreserveObject(value);
+        aj->value = value;
     }
     else
     {
-        work(0);
+        aj->error = err;
     }
+    UNPROTECT(1);
+}
 
-    // Collect any profiler data
-    for (unsigned int t = 0; t < l.size(); ++t)
-        luajr_profile_collect(l[t]);
+// Discard a finished asynchronous job without collecting its results.
+static void discard_async_job(AsyncJob* aj)
+{
+    std::string err;
+    aj->job->Finish(false, err);
+    delete aj->job;
+    R_ReleaseObject(aj->keep);
+    delete aj;
+}
 
-    // Handle errors
-    if (!error_msg.empty())
+// Cancelled asynchronous jobs whose handles have been garbage collected while
+// they were still running, to be discarded once they have finished.
+static std::vector<AsyncJob*> orphaned_jobs;
+
+// Discard any orphaned jobs that have finished.
+static void reap_orphaned_jobs()
+{
+    for (auto it = orphaned_jobs.begin(); it != orphaned_jobs.end(); )
     {
-        // Close states, if lua_parallel created them
-        if (TYPEOF(threads) == INTSXP)
-            for (unsigned int t = 0; t < l.size(); ++t)
-                lua_close(l[t]);
-        // Otherwise, clear stacks (as may be quite full)
-        if (TYPEOF(threads) == VECSXP)
-            for (unsigned int t = 0; t < l.size(); ++t)
-                lua_settop(l[t], 0);
-        // Stop with error
-        Rf_error("%s", error_msg.c_str());
+        if ((*it)->job->Finished())
+        {
+            discard_async_job(*it);
+            it = orphaned_jobs.erase(it);
+        }
+        else
+            ++it;
     }
+}
 
-    // Assign computed values to list
-    int nprotect = 0;
-    for (unsigned int t = 0; t < l.size(); ++t)
+// Wait for any orphaned jobs using [pool], which have been cancelled and so
+// should stop soon, then discard them.
+static void wait_orphaned_jobs(LuaPool* pool)
+{
+    for (size_t j = 0; j < orphaned_jobs.size(); ++j)
+        if (orphaned_jobs[j]->job->GetPool() == pool)
+            while (!orphaned_jobs[j]->job->Wait(0.05))
+                R_CheckUserInterrupt();
+    reap_orphaned_jobs();
+}
+
+// Destroy an AsyncJob pointed to by an R external pointer when it is no
+// longer needed. A job which is still running is cancelled and left to
+// finish in the background, rather than waiting for it during garbage
+// collection; it is discarded later by reap_orphaned_jobs().
+static void finalize_async_job(SEXP xptr)
+{
+    AsyncJob* aj = reinterpret_cast<AsyncJob*>(R_ExternalPtrAddr(xptr));
+    R_ClearExternalPtr(xptr);
+    if (!aj)
+        return;
+    if (aj->value != R_NilValue)
+    {
+        R_ReleaseObject(aj->value);
+        aj->value = R_NilValue;
+    }
+    if (!aj->job)
+        delete aj;
+    else if (aj->job->Finished())
+        discard_async_job(aj);
+    else
+    {
+        aj->job->Cancel();
+        orphaned_jobs.push_back(aj);
+    }
+}
+
+// Get the AsyncJob from an R external pointer, or stop with an error.
+static AsyncJob* get_async_job(SEXP job)
+{
+    AsyncJob* aj = reinterpret_cast<AsyncJob*>(luajr_getpointer(job, LUAJR_JOB_CODE));
+    if (!aj)
+        Rf_error("job parameter is not a valid lua_parallel job.");
+    return aj;
+}
+
+// Open [threads] new Lua states (or use [threads] if a list of states or a
+// pool), run code [pre] in each one, then run "return [func]" to get a
+// function. Call the func(i) with i in 1 to n, dividing the iterations among
+// the threads according to [schedule] and [chunk]. If [range] is TRUE, call
+// func(first, last) once for each range of iterations instead. If
+// [fun_value] is not NULL, return the results in a vector or matrix of the
+// same type as [fun_value], with one row per element of [fun_value], rather
+// than a list. If [reduce] is not NULL, combine the values returned by func
+// into one value instead, using the built-in operation "+", "min" or "max",
+// or the Lua function that [reduce] evaluates to. If [map] is not null, call
+// func(x, first, last) instead, where x is a slice of the object described by
+// [map]. If [async] is TRUE, return a handle to the running job at once
+// instead of waiting for the results.
+static SEXP run_parallel(SEXP func, SEXP n, SEXP threads, SEXP pre,
+    SEXP schedule, SEXP chunk, SEXP range, SEXP fun_value, SEXP reduce,
+    SEXP async, SEXP timeout, const MapSpec* map)
+{
+    CheckSEXPLen(func, STRSXP, 1);
+    CheckSEXPLen(n, INTSXP, 1);
+    CheckSEXPLen(pre, STRSXP, 1);
+    CheckSEXPLen(schedule, STRSXP, 1);
+    CheckSEXPLen(chunk, INTSXP, 1);
+    CheckSEXPLen(range, LGLSXP, 1);
+    CheckSEXPLen(async, LGLSXP, 1);
+    CheckSEXPLen(timeout, REALSXP, 1);
+    reap_orphaned_jobs();
+
+    // Ensure n is sensible; the schedules work with iteration numbers up to
+    // n + 1, so n must be less than INT_MAX
+    int n_iter = INTEGER(n)[0];
+    if (n_iter < 0) // also covers NA_INTEGER
+        Rf_error("Invalid number of iterations.");
+    if (n_iter > INT_MAX - 1)
+        Rf_error("lua_parallel does not support more than %d iterations.", INT_MAX - 1);
+
+    // Get schedule
+    Schedule::Kind sched_kind;
+    const char* sched_str = CHAR(STRING_ELT(schedule, 0));
+    if (strcmp(sched_str, "static") == 0)
+        sched_kind = Schedule::STATIC;
+    else if (strcmp(sched_str, "dynamic") == 0)
+        sched_kind = Schedule::DYNAMIC;
+    else if (strcmp(sched_str, "guided") == 0)
+        sched_kind = Schedule::GUIDED;
+    else if (strcmp(sched_str, "stealing") == 0)
+        sched_kind = Schedule::STEALING;
+    else
+        Rf_error("Invalid schedule '%s'; must be 'static', 'dynamic', 'guided', or 'stealing'.", sched_str);
+    int chunk_size = INTEGER(chunk)[0] == NA_INTEGER ? 0 : INTEGER(chunk)[0];
+    if (chunk_size < 0)
+        Rf_error("Invalid chunk size.");
+    bool range_call = LOGICAL(range)[0] == TRUE;
+    bool run_async = LOGICAL(async)[0] == TRUE;
+    double timeout_secs = ISNAN(REAL(timeout)[0]) ? R_PosInf : REAL(timeout)[0];
+    if (timeout_secs < 0)
+        Rf_error("Invalid timeout.");
+
+    // Get type of result
+    SEXP result = R_NilValue;
+    bool typed = fun_value != R_NilValue;
+    TypedResult tr { 0, 0, 0, NA_REAL };
+    if (typed)
     {
-        while (lua_isnumber(l[t], -1))
+        tr.type = TYPEOF(fun_value);
+        tr.k = Rf_length(fun_value);
+        if ((tr.type != LGLSXP && tr.type != INTSXP && tr.type != REALSXP) || tr.k < 1)
+            Rf_error("FUN.VALUE must be a logical, integer, or numeric vector of length at least 1.");
+    }
+
+    // Get reduction
+    Reduction red { Reduction::NONE, "" };
+    if (reduce != R_NilValue)
+    {
+        CheckSEXPLen(reduce, STRSXP, 1);
+        if (typed)
+            Rf_error("Cannot use both FUN.VALUE and reduce.");
+        if (STRING_ELT(reduce, 0) == NA_STRING)
+            Rf_error("Invalid reduce.");
+        const char* red_str = CHAR(STRING_ELT(reduce, 0));
+        if (strcmp(red_str, "+") == 0)
+            red.op = Reduction::SUM;
+        else if (strcmp(red_str, "min") == 0)
+            red.op = Reduction::MIN;
+        else if (strcmp(red_str, "max") == 0)
+            red.op = Reduction::MAX;
+        else
         {
-            if (result == R_NilValue)
-            {
-                result = PROTECT(Rf_allocVector(VECSXP, n_iter));
-                ++nprotect;
-            }
-            int index = lua_tointeger(l[t], -1);
-            int nret = lua_tointeger(l[t], -2);
-            lua_pop(l[t], 2);
-            SET_VECTOR_ELT(result, index - 1, luajr_return(l[t], nret));
+            red.op = Reduction::CUSTOM;
+            red.cmd = "return ";
+            red.cmd += red_str;
         }
     }
 
-    // Close states, if lua_parallel created them
-    if (TYPEOF(threads) == INTSXP)
+    // Don't multi-thread in debug mode, as the debugger needs the console.
+    // (The profiler does work across threads; see luajr_pcall().)
+    bool single_thread = false;
+    if (luajr_debug_mode())
+    {
+        single_thread = true;
+        Rf_warningcall_immediate(R_NilValue, "luajr debugger is active, so lua_parallel will only use one thread.");
+    }
+
+    // Get Lua states for each thread, checking they are not in use by an
+    // asynchronous job
+    std::vector<lua_State*> l;
+    LuaPool* pool = 0;
+    bool own_states = false;
+    if (TYPEOF(threads) == INTSXP && Rf_length(threads) == 1)
+    {
+        int n_threads = single_thread ? 1 : INTEGER(threads)[0];
+        if (n_threads <= 0) // also covers NA_INTEGER
+            Rf_error("Invalid number of threads.");
+        l.assign(n_threads, 0);
+        own_states = true;
+    }
+    else if (TYPEOF(threads) == VECSXP && Rf_length(threads) > 0)
+    {
+        l.assign(single_thread ? 1 : Rf_length(threads), 0);
+        // The states could be used from R while an asynchronous job runs, so
+        // they can only be used synchronously
+        if (run_async)
+            Rf_error("Cannot use a list of Lua states with async = TRUE; use a number of threads or a Lua pool.");
         for (unsigned int t = 0; t < l.size(); ++t)
-            lua_close(l[t]);
+        {
+            l[t] = luajr_getstate(VECTOR_ELT(threads, t));
+            for (unsigned int u = 0; u < t; ++u)
+                if (l[u] == l[t])
+                    Rf_error("Cannot use the same Lua state across multiple threads.");
+        }
+    }
+    else if (TYPEOF(threads) == EXTPTRSXP)
+    {
+        pool = reinterpret_cast<LuaPool*>(luajr_getpointer(threads, LUAJR_POOL_CODE));
+        if (!pool)
+            Rf_error("threads parameter is not a valid Lua pool.");
+        if (pool->busy)
+            wait_orphaned_jobs(pool);
+        if (pool->busy)
+            Rf_error("Cannot use a Lua pool which is in use by an asynchronous lua_parallel job.");
+        l.assign(pool->states.begin(), single_thread ? pool->states.begin() + 1 : pool->states.end());
+    }
+    else
+    {
+        Rf_error("threads parameter must be an integer, a list of Lua states, or a Lua pool.");
+    }
+
+    // Assemble statement that returns Lua function
+    std::string cmd = "return ";
+    cmd += CHAR(STRING_ELT(func, 0));
+
+    // Get pre-run code
+    const char* pre_code = 0;
+    if (STRING_ELT(pre, 0) != NA_STRING)
+        pre_code = CHAR(STRING_ELT(pre, 0));
+
+    // Preallocate typed result
+    int nprotect = 0;
+    if (typed)
+    {
+        if (tr.k == 1)
+            result = PROTECT(Rf_allocVector(tr.type, n_iter));
+        else
+            result = PROTECT(Rf_allocMatrix(tr.type, tr.k, n_iter));
+        ++nprotect;
+        if (tr.type == REALSXP)
+            tr.data = REAL(result);
+        else if (tr.type == INTSXP)
+            tr.data = INTEGER(result);
+        else
+            tr.data = LOGICAL(result);
+
+        SEXP names = Rf_getAttrib(fun_value, R_NamesSymbol);
+        if (tr.k > 1 && names != R_NilValue)
+        {
+            SEXP dimnames = PROTECT(Rf_allocVector(VECSXP, 2));
+            SET_VECTOR_ELT(dimnames, 0, names);
+            Rf_setAttrib(result, R_DimNamesSymbol, dimnames);
+            UNPROTECT(1);
+        }
+    }
+
+    ParallelJob* job = new ParallelJob(l, pool, own_states, cmd, pre_code,
+        sched_kind, n_iter, chunk_size, range_call, tr, result, red, map);
+
+    // For an asynchronous job, keep the R objects it uses (the pool or states,
+    // the typed result, and the object being mapped over) from being garbage
+    // collected until it has finished, then start it and return a handle. In
+    // debug mode, the job runs to completion here, in the main thread.
+    if (run_async)
+    {
+        SEXP keep = PROTECT(Rf_allocVector(VECSXP, 3));
+        SET_VECTOR_ELT(keep, 0, threads);
+        SET_VECTOR_ELT(keep, 1, result);
+        SET_VECTOR_ELT(keep, 2, map ? map->x : R_NilValue);
+        AsyncJob* aj = new AsyncJob { job, keep, R_NilValue, "", n_iter };
+        SEXP handle = PROTECT(luajr_makepointer(aj, LUAJR_JOB_CODE, finalize_async_job));
+        R_PreserveObject(keep);
+        job->Start(!single_thread, timeout_secs);
+        UNPROTECT(nprotect + 2);
+        return handle;
+    }
+
+    // Otherwise, run the job, allowing the user to interrupt it, and collect
+    // the results
+    job->Start(false, timeout_secs);
+    job->WaitInterruptible();
+    std::string error_msg;
+    result = PROTECT(job->Finish(true, error_msg));
+    ++nprotect;
+    delete job;
+
+    // Stop with error
+    if (!error_msg.empty())
+        Rf_error("%s", error_msg.c_str());
 
     UNPROTECT(nprotect);
     return result;
 }
+
+// Run lua_parallel with the given options.
+extern "C" SEXP luajr_parallel(SEXP func, SEXP n, SEXP threads, SEXP pre,
+    SEXP schedule, SEXP chunk, SEXP range, SEXP fun_value, SEXP reduce,
+    SEXP async, SEXP timeout)
+{
+    return run_parallel(func, n, threads, pre, schedule, chunk, range, fun_value, reduce, async, timeout, 0);
+}
+
+// Number of rows of the data frame [x], from its row names, so that this is
+// also right for a data frame with no columns. Rf_getAttrib() expands R's
+// compact representation of automatic row names, c(NA, +/-nrow), but this
+// is returned as a compact sequence, so taking its length is cheap.
+static R_xlen_t dataframe_nrow(SEXP x)
+{
+    return Rf_xlength(Rf_getAttrib(x, R_RowNamesSymbol));
+}
+
+// Run lua_parallel_map: call func(x, first, last) in parallel, where x is a
+// read-only slice of elements (or matrix columns, or data frame rows) first
+// to last of [X]. The slices share the memory of [X], which is protected as
+// an argument to .Call for the duration (or, with [async], by the job).
+extern "C" SEXP luajr_parallel_map(SEXP func, SEXP X, SEXP threads, SEXP pre,
+    SEXP schedule, SEXP chunk, SEXP fun_value, SEXP reduce, SEXP async,
+    SEXP timeout)
+{
+    // Get data pointer and type code of an R vector column
+    auto column = [](MapSpec& spec, SEXP x, const char* name, int c) {
+        switch (TYPEOF(x))
+        {
+            case LGLSXP:  spec.ptr.push_back(LOGICAL(x)); spec.type.push_back(LOGICAL_T); break;
+            case INTSXP:  spec.ptr.push_back(INTEGER(x)); spec.type.push_back(INTEGER_T); break;
+            case REALSXP: spec.ptr.push_back(REAL(x));    spec.type.push_back(NUMERIC_T); break;
+            default:
+                if (c > 0)
+                    Rf_error("lua_parallel_map does not support data frame columns of type %s (column %d).",
+                        Rf_type2char(TYPEOF(x)), c);
+                Rf_error("lua_parallel_map does not support X of type %s.", Rf_type2char(TYPEOF(x)));
+        }
+        spec.names.push_back(name);
+    };
+
+    MapSpec spec;
+    spec.x = X;
+    R_xlen_t n_iter = 0;
+    if (Rf_isFrame(X))
+    {
+        spec.kind = 2;
+        SEXP names = Rf_getAttrib(X, R_NamesSymbol);
+        for (int c = 0; c < Rf_length(X); ++c)
+            column(spec, VECTOR_ELT(X, c), names == R_NilValue ? "" : CHAR(STRING_ELT(names, c)), c + 1);
+        n_iter = dataframe_nrow(X);
+        spec.nrow = n_iter;
+    }
+    else if (Rf_isMatrix(X))
+    {
+        spec.kind = 1;
+        column(spec, X, "", 0);
+        spec.nrow = Rf_nrows(X);
+        n_iter = Rf_ncols(X);
+    }
+    else
+    {
+        spec.kind = 0;
+        column(spec, X, "", 0);
+        n_iter = Rf_xlength(X);
+        spec.nrow = n_iter;
+    }
+
+    if (n_iter > INT_MAX - 1)
+        Rf_error("lua_parallel_map does not support X with more than %d elements, rows, or columns.", INT_MAX - 1);
+
+    SEXP n = PROTECT(Rf_ScalarInteger((int)n_iter));
+    SEXP range = PROTECT(Rf_ScalarLogical(TRUE));
+    SEXP result = run_parallel(func, n, threads, pre, schedule, chunk, range, fun_value, reduce, async, timeout, &spec);
+    UNPROTECT(2);
+    return result;
+}
+
+// Run lua_parallel with the default schedule.
+extern "C" SEXP luajr_run_parallel(SEXP func, SEXP n, SEXP threads, SEXP pre)
+{
+    SEXP schedule = PROTECT(Rf_mkString("dynamic"));
+    SEXP chunk = PROTECT(Rf_ScalarInteger(1));
+    SEXP range = PROTECT(Rf_ScalarLogical(FALSE));
+    SEXP async = PROTECT(Rf_ScalarLogical(FALSE));
+    SEXP timeout = PROTECT(Rf_ScalarReal(R_PosInf));
+    SEXP result = luajr_parallel(func, n, threads, pre, schedule, chunk, range, R_NilValue, R_NilValue, async, timeout);
+    UNPROTECT(5);
+    return result;
+}
+
+// Get the progress of an asynchronous lua_parallel job: the number of
+// iterations done, the total number of iterations, whether the job has
+// finished, and the error message, if any.
+extern "C" SEXP luajr_job_poll(SEXP job)
+{
+    AsyncJob* aj = get_async_job(job);
+    reap_orphaned_jobs();
+
+    bool finished = !aj->job || aj->job->Finished();
+    double done = aj->job ? aj->job->Done() : aj->error.empty() ? aj->n : NA_REAL;
+    std::string error = aj->job ? aj->job->Error() : aj->error;
+
+    SEXP ret = PROTECT(Rf_allocVector(VECSXP, 4));
+    SET_VECTOR_ELT(ret, 0, Rf_ScalarReal(done));
+    SET_VECTOR_ELT(ret, 1, Rf_ScalarInteger(aj->n));
+    SET_VECTOR_ELT(ret, 2, Rf_ScalarLogical(finished));
+    SET_VECTOR_ELT(ret, 3, error.empty() ? Rf_ScalarString(NA_STRING) : Rf_mkString(error.c_str()));
+
+    SEXP names = PROTECT(Rf_allocVector(STRSXP, 4));
+    SET_STRING_ELT(names, 0, Rf_mkChar("done"));
+    SET_STRING_ELT(names, 1, Rf_mkChar("n"));
+    SET_STRING_ELT(names, 2, Rf_mkChar("finished"));
+    SET_STRING_ELT(names, 3, Rf_mkChar("error"));
+    Rf_setAttrib(ret, R_NamesSymbol, names);
+
+    UNPROTECT(2);
+    return ret;
+}
+
+// Wait for up to [timeout] seconds for an asynchronous lua_parallel job to
+// finish. If it has finished, return its results (collecting them from the
+// Lua states first, if this has not already been done) or stop with its
+// error; otherwise, return NULL. Waits in short steps so that the user can
+// interrupt the wait, which leaves the job running.
+extern "C" SEXP luajr_job_wait(SEXP job, SEXP timeout)
+{
+    AsyncJob* aj = get_async_job(job);
+    CheckSEXPLen(timeout, REALSXP, 1);
+    reap_orphaned_jobs();
+
+    if (aj->job)
+    {
+        double wait = ISNAN(REAL(timeout)[0]) ? R_PosInf : std::max(0.0, REAL(timeout)[0]);
+        auto start = std::chrono::steady_clock::now();
+        for (;;)
+        {
+            double elapsed = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+            if (aj->job->Wait(std::max(0.0, std::min(wait - elapsed, 0.1))))
+                break;
+            if (elapsed >= wait)
+                return R_NilValue;
+            R_CheckUserInterrupt();
+        }
+        collect_async_job(aj);
+    }
+
+    if (!aj->error.empty())
+        Rf_error("%s", aj->error.c_str());
+    return aj->value;
+}
+
+// Cancel an asynchronous lua_parallel job. Each thread stops before its next
+// iteration, and Lua code it is running is interrupted by the stop hook,
+// except for loops compiled by the JIT compiler and calls to C functions.
+extern "C" SEXP luajr_job_cancel(SEXP job)
+{
+    AsyncJob* aj = get_async_job(job);
+    if (aj->job)
+        aj->job->Cancel();
+    return R_NilValue;
+}
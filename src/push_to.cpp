@@ -5,22 +5,520 @@
 #include <vector>
 #include <string>
 #include <cstring>
+#include <cmath>
+#include <climits>
 #include <limits>
+#include <cstdarg>
+#include <cstdio>
 extern "C" {
 #include "lua.h"
 #include "luajit/src/lj_def.h"
+#include "luajit/src/lj_obj.h"
+#include "luajit/src/lj_ctype.h"
 }
 #define R_NO_REMAP
 #include <R.h>
 #include <Rinternals.h>
 
-// Additional types specific to LuaJIT. From lj_obj.h.
-#define LUA_TPROTO	(LUA_TTHREAD+1)
-#define LUA_TCDATA	(LUA_TTHREAD+2)
+// Additional types specific to LuaJIT (LUA_TPROTO, LUA_TCDATA) and table
+// internals come from lj_obj.h; C type internals come from lj_ctype.h.
+
+// Conversion context. Converting values between R and Lua uses a handful of
+// luajr helpers, such as luajr.construct_vec(). When many values are converted
+// at once, by luajr_pass() or luajr_return(), these are looked up once for the
+// whole batch from a per-state table of helpers (see luajr_conv_register())
+// rather than from the registry once per value. luajr_pass() also does all of
+// its conversions inside one protected call, in which case [errbuf] is set:
+// helpers are then called with lua_call(), and errors are raised as Lua errors
+// with the message saved in errbuf, since R errors must not unwind Lua frames.
+// For the same reason, R calls which can raise an error, such as reading the
+// data of an ALTREP vector, are then made through conv_r().
+struct Conv
+{
+    int helpers;                // Stack index (or upvalue index) of the table of helpers
+    char* errbuf;               // If set, converting within a protected call
+    const struct ConvTypes* types; // luajr types, for returning values to R
+};
+
+// The luajr types, cached per state so that values returned to R can be
+// identified with a few comparisons rather than by calling into Lua: the
+// CTypeIDs of luajr cdata types with their type codes (see
+// luajr.ctype_codes), and the list, character vector and chunked view
+// metatables.
+struct ConvTypes
+{
+    static const int max = 16;
+    int n;
+    CTypeID ctypeid[max];
+    int code[max];
+    const GCtab* list_mt;
+    const GCtab* character_mt;
+    const GCtab* chunked_mt;
+};
+
+// Size of Conv::errbuf
+static const int CONV_ERRBUF_SIZE = 512;
+
+// Indices into the table of helpers
+enum
+{
+    CONV_CONSTRUCT_REF = 1, CONV_CONSTRUCT_VEC, CONV_CONSTRUCT_LIST,
+    CONV_CONSTRUCT_NULL, CONV_CHUNKED, CONV_FFI_NEW, CONV_LOGICAL_R,
+    CONV_INTEGER_R, CONV_NUMERIC_R, CONV_LOGICAL_MATRIX_R, CONV_INTEGER_MATRIX_R,
+    CONV_NUMERIC_MATRIX_R, CONV_NA_CHARACTER, CONV_CHARACTER_MT,
+    CONV_LIST_MT, CONV_CHUNKED_MT, CONV_CTYPE_CODES, CONV_N = CONV_CTYPE_CODES,
+    CONV_TYPES // ConvTypes userdata, made in luajr_conv_register()
+};
+
+// Registry keys of the helpers, in the same order
+static void* const conv_keys[CONV_N + 1] = { 0,
+    (void*)&luajr_construct_ref, (void*)&luajr_construct_vec, (void*)&luajr_construct_list,
+    (void*)&luajr_construct_null, (void*)&luajr_chunked, (void*)&luajr_ffi_new,
+    (void*)&luajr_logical_r, (void*)&luajr_integer_r, (void*)&luajr_numeric_r,
+    (void*)&luajr_logical_matrix_r, (void*)&luajr_integer_matrix_r,
+    (void*)&luajr_numeric_matrix_r, (void*)&luajr_na_character, (void*)&luajr_character_mt, (void*)&luajr_list_mt,
+    (void*)&luajr_chunked_mt, (void*)&luajr_ctype_codes
+};
+
+// Push helper [i] onto the stack
+static void conv_get(lua_State* L, const Conv* cv, int i)
+{
+    if (cv)
+        lua_rawgeti(L, cv->helpers, i);
+    else
+    {
+        lua_pushlightuserdata(L, conv_keys[i]);
+        lua_rawget(L, LUA_REGISTRYINDEX);
+    }
+}
+
+// Call a helper, like lua_call()
+static void conv_call(lua_State* L, const Conv* cv, int nargs, int nresults, const char* what)
+{
+    if (cv && cv->errbuf)
+        lua_call(L, nargs, nresults);
+    else
+        luajr_pcall(L, nargs, nresults, what, LUAJR_TOOLING_NONE);
+}
+
+// Raise an error during conversion, like Rf_error()
+static void conv_error(lua_State* L, const Conv* cv, const char* fmt, ...)
+{
+    char buf[CONV_ERRBUF_SIZE];
+    va_list args;
+    va_start(args, fmt);
+    std::vsnprintf(buf, CONV_ERRBUF_SIZE, fmt, args);
+    va_end(args);
+
+    if (cv && cv->errbuf)
+    {
+        std::strcpy(cv->errbuf, buf);
+        lua_pushstring(L, buf);
+        lua_error(L);
+    }
+    Rf_error("%s", buf);
+}
+
+// Error handler for conv_r(): save the condition message in [errbuf].
+static SEXP conv_r_handler(SEXP cond, void* errbuf)
+{
+    const char* msg = "R error during conversion.";
+    if (TYPEOF(cond) == VECSXP && Rf_length(cond) > 0 &&
+        TYPEOF(VECTOR_ELT(cond, 0)) == STRSXP && Rf_length(VECTOR_ELT(cond, 0)) > 0)
+        msg = CHAR(STRING_ELT(VECTOR_ELT(cond, 0), 0));
+    std::snprintf(reinterpret_cast<char*>(errbuf), CONV_ERRBUF_SIZE, "%s", msg);
+    return R_NilValue;
+}
+
+// Do the R-side step f(), which may raise an R error. Within a protected
+// call, this runs f() under R_tryCatchError, so that an R error does not jump
+// out through Lua frames, and raises it again as a Lua error with the message
+// saved in errbuf, as conv_error() does. f() must not call Lua.
+template <typename F>
+static void conv_r(lua_State* L, const Conv* cv, F f)
+{
+    if (!cv || !cv->errbuf)
+    {
+        f();
+        return;
+    }
+
+    cv->errbuf[0] = 0;
+    R_tryCatchError([](void* f) -> SEXP { (*reinterpret_cast<F*>(f))(); return R_NilValue; },
+        &f, conv_r_handler, cv->errbuf);
+    if (cv->errbuf[0])
+    {
+        lua_pushstring(L, cv->errbuf);
+        lua_error(L);
+    }
+}
+
+// Arguments for conv_getattrib()
+struct ConvAttrib
+{
+    SEXP x;
+    SEXP name;
+};
+
+static SEXP conv_getattrib_body(void* data)
+{
+    ConvAttrib* a = reinterpret_cast<ConvAttrib*>(data);
+    return Rf_getAttrib(a->x, a->name);
+}
+
+// Get the attribute [name] of [x], like Rf_getAttrib(), which allocates for
+// some attributes, such as compact row names. Within a protected call, this
+// runs under R_tryCatchError as conv_r() does; the attribute is returned
+// through R_tryCatchError, so it cannot be collected before the caller
+// protects it.
+static SEXP conv_getattrib(lua_State* L, SEXP x, SEXP name, const Conv* cv)
+{
+    if (!cv || !cv->errbuf)
+        return Rf_getAttrib(x, name);
+
+    ConvAttrib a = { x, name };
+    cv->errbuf[0] = 0;
+    SEXP attr = R_tryCatchError(conv_getattrib_body, &a, conv_r_handler, cv->errbuf);
+    if (cv->errbuf[0])
+    {
+        lua_pushstring(L, cv->errbuf);
+        lua_error(L);
+    }
+    return attr;
+}
+
+// Read from the vector [x] with f(), through conv_r() if x is an ALTREP
+// vector, as its methods can call R code which raises an error or allocates
+// memory. Other vectors are read directly.
+template <typename F>
+static void conv_read(lua_State* L, const Conv* cv, SEXP x, F f)
+{
+    if (ALTREP(x))
+        conv_r(L, cv, f);
+    else
+        f();
+}
+
+// Materialise the data of [x] if it is an ALTREP vector, before the
+// conversion gets a pointer to its data, so that getting the pointer (here or
+// in a luajr helper) does not then call R code.
+static void conv_materialise(lua_State* L, SEXP x, const Conv* cv)
+{
+    conv_read(L, cv, x, [x] {
+        switch (TYPEOF(x))
+        {
+            case LGLSXP:  (void)LOGICAL_RO(x); break;
+            case INTSXP:  (void)INTEGER_RO(x); break;
+            case REALSXP: (void)REAL_RO(x); break;
+            case STRSXP:  (void)STRING_PTR_RO(x); break;
+            case RAWSXP:  (void)RAW(x); break;
+        }
+    });
+}
+
+// Helper function to push a logical, integer or numeric vector to the Lua
+// stack as a table. This writes the values straight into the table's array
+// part instead of going through lua_rawseti() for each element. Numbers, NaNs
+// and booleans are not garbage-collected objects, so no write barrier is
+// needed; NaNs must be canonicalized, as lua_pushnumber() does.
+static void push_R_table(lua_State* L, SEXP x, R_xlen_t xlen, int type, const Conv* cv)
+{
+    conv_materialise(L, x, cv);
+    lua_createtable(L, xlen, 0);
+
+    // For tables, lua_topointer() returns the GCtab itself
+    GCtab* t = (GCtab*)lua_topointer(L, -1);
+    if (t->asize <= (uint32_t)xlen)
+        conv_error(L, cv, "Could not allocate array part of Lua table.");
+    TValue* arr = tvref(t->array) + 1; // keys start at 1
+
+    switch (type)
+    {
+        case LOGICAL_T:
+        {
+            const int* p = LOGICAL_RO(x);
+            for (R_xlen_t i = 0; i < xlen; ++i)
+                setboolV(&arr[i], p[i] != 0);
+            break;
+        }
+        case INTEGER_T:
+        {
+            const int* p = INTEGER_RO(x);
+            for (R_xlen_t i = 0; i < xlen; ++i)
+                setintV(&arr[i], p[i]);
+            break;
+        }
+        case NUMERIC_T:
+        {
+            const double* p = REAL_RO(x);
+            for (R_xlen_t i = 0; i < xlen; ++i)
+            {
+                if (p[i] != p[i])
+                    setnanV(&arr[i]);
+                else
+                    setnumV(&arr[i], p[i]);
+            }
+            break;
+        }
+    }
+}
+
+// Helper function to return a plain Lua table at [index] as an atomic vector,
+// if it is a non-empty array of numbers, booleans, or strings of a single type
+// with keys 1 to n. This reads the table's array and hash parts directly.
+// Returns 0 if the table does not qualify, e.g. if it has any non-integer keys
+// or any holes, in which case it should be returned as a list.
+static SEXP table_to_vector(lua_State* L, int index)
+{
+    const GCtab* t = (const GCtab*)lua_topointer(L, index);
+    const TValue* arr = tvref(t->array);
+    const Node* node = noderef(t->node);
+
+    // Type of R vector to create, according to the type of element k
+    auto elem_type = [](const TValue* o) -> int {
+        if (tvisnumber(o)) return REALSXP;
+        if (tvisbool(o)) return LGLSXP;
+        if (tvisstr(o) && std::strlen(strVdata(o)) == strV(o)->len) return STRSXP;
+        return NILSXP;
+    };
+
+    // First pass: check that all elements have the same type and positive
+    // integer keys, and that the largest key is equal to the number of elements
+    int rtype = NILSXP;
+    double n = 0, maxkey = 0;
+    for (uint32_t i = 0; i < t->asize; ++i)
+    {
+        if (tvisnil(&arr[i]))
+            continue;
+        if (i == 0)
+            return 0;
+        int et = elem_type(&arr[i]);
+        if (et == NILSXP || (rtype != NILSXP && et != rtype))
+            return 0;
+        rtype = et;
+        n += 1;
+        maxkey = i;
+    }
+    for (uint32_t i = 0; i <= t->hmask; ++i)
+    {
+        if (tvisnil(&node[i].val))
+            continue;
+        if (!tvisnumber(&node[i].key))
+            return 0;
+        double k = numberVnum(&node[i].key);
+        if (!(k >= 1 && k <= (double)R_XLEN_T_MAX) || k != std::floor(k)) // also rejects NaN
+            return 0;
+        int et = elem_type(&node[i].val);
+        if (et == NILSXP || (rtype != NILSXP && et != rtype))
+            return 0;
+        rtype = et;
+        n += 1;
+        if (k > maxkey) maxkey = k;
+    }
+    if (n == 0 || maxkey != n)
+        return 0;
+
+    // Second pass: create the vector
+    SEXP retval = PROTECT(Rf_allocVector(rtype, (R_xlen_t)n));
+    double* rp = rtype == REALSXP ? REAL(retval) : 0;
+    int* lp = rtype == LGLSXP ? LOGICAL(retval) : 0;
+    auto set = [rtype, retval, rp, lp](R_xlen_t i, const TValue* o) {
+        switch (rtype)
+        {
+            case REALSXP:
+                rp[i] = numberVnum(o);
+                break;
+            case LGLSXP:
+                lp[i] = tvistrue(o);
+                break;
+            case STRSXP:
+                SET_STRING_ELT(retval, i, Rf_mkCharLen(strVdata(o), strV(o)->len));
+                break;
+        }
+    };
+    for (uint32_t i = 1; i < t->asize; ++i)
+        if (!tvisnil(&arr[i]))
+            set(i - 1, &arr[i]);
+    for (uint32_t i = 0; i <= t->hmask; ++i)
+        if (!tvisnil(&node[i].val))
+            set((R_xlen_t)numberVnum(&node[i].key) - 1, &node[i].val);
+    UNPROTECT(1);
+    return retval;
+}
+
+// Helper function to push a logical, integer or numeric reference type to the
+// Lua stack. Rather than calling luajr.construct_ref(), which would construct
+// the reference type in Lua and then call back into SetNumericRef() etc via the
+// FFI, this calls ffi.new() directly on the reference type's ctype and then
+// fills in the new cdata's payload from C++.
+static void push_R_ref(lua_State* L, SEXP x, int type, const Conv* cv)
+{
+    // Get ffi.new() and the reference type's ctype on the stack
+    conv_get(L, cv, CONV_FFI_NEW);
+    conv_get(L, cv, CONV_LOGICAL_R + type);
+
+    // Allocate the cdata. This goes straight to the ffi.new() builtin, so the
+    // only possible error is a memory allocation error; we still need to call
+    // it in protected mode for that, but luajr_pcall() is not needed here.
+    if (cv && cv->errbuf)
+        lua_call(L, 1, 1);
+    else
+        luajr_handle_lua_error(L, lua_pcall(L, 1, 1, 0), "ffi.new() from push_R_ref()", 0);
+
+    // For cdata, lua_topointer() returns a pointer to the cdata's payload
+    void* payload = const_cast<void*>(lua_topointer(L, -1));
+    conv_materialise(L, x, cv);
+    switch (type)
+    {
+        case LOGICAL_T: SetLogicalRef(reinterpret_cast<logical_rt*>(payload), x); break;
+        case INTEGER_T: SetIntegerRef(reinterpret_cast<integer_rt*>(payload), x); break;
+        case NUMERIC_T: SetNumericRef(reinterpret_cast<numeric_rt*>(payload), x); break;
+    }
+}
+
+// Stop if length of chr exceeds LuaJIT limits.
+static void check_string_length(lua_State* L, SEXP chr, const Conv* cv)
+{
+    R_xlen_t xlen = Rf_xlength(chr);
+    if (xlen >= LJ_MAX_STR)
+        conv_error(L, cv, "Cannot pass string with more than %d bytes. Requested size: %.0f.", LJ_MAX_STR, (double)xlen);
+}
+
+// Helper function to push a logical, integer or numeric matrix to the Lua stack
+// as a matrix reference type, in the same way as push_R_ref().
+static void push_R_matrix(lua_State* L, SEXP x, int type, const Conv* cv)
+{
+    SEXP dim = Rf_getAttrib(x, R_DimSymbol);
+    if (TYPEOF(dim) != INTSXP || Rf_length(dim) != 2)
+        conv_error(L, cv, "Arg code m requires a matrix, but passed %s vector without two dimensions.",
+            Rf_type2char(TYPEOF(x)));
+
+    // Get ffi.new() and the matrix reference type's ctype on the stack
+    conv_get(L, cv, CONV_FFI_NEW);
+    conv_get(L, cv, CONV_LOGICAL_MATRIX_R + type);
+
+    // Allocate the cdata
+    if (cv && cv->errbuf)
+        lua_call(L, 1, 1);
+    else
+        luajr_handle_lua_error(L, lua_pcall(L, 1, 1, 0), "ffi.new() from push_R_matrix()", 0);
+
+    void* payload = const_cast<void*>(lua_topointer(L, -1));
+    conv_materialise(L, x, cv);
+    switch (type)
+    {
+        case LOGICAL_T: SetLogicalMatrixRef(reinterpret_cast<logical_matrix_rt*>(payload), x); break;
+        case INTEGER_T: SetIntegerMatrixRef(reinterpret_cast<integer_matrix_rt*>(payload), x); break;
+        case NUMERIC_T: SetNumericMatrixRef(reinterpret_cast<numeric_matrix_rt*>(payload), x); break;
+    }
+}
+
+// Small direct-mapped cache, used when converting character vectors, so that
+// repeated strings are only looked up once. Keys are pointers to strings that
+// are interned by R (CHARSXPs) or by Lua, so equal keys mean equal strings.
+template <typename V>
+struct StringCache
+{
+    static const unsigned int size = 256;
+    const void* key[size] = { 0 };
+    V value[size];
+
+    static unsigned int slot(const void* k)
+        { return ((uintptr_t)k >> 4) & (size - 1); }
+    bool get(const void* k, V& v) const
+        { unsigned int i = slot(k); if (key[i] == k) { v = value[i]; return true; } return false; }
+    void put(const void* k, V v)
+        { unsigned int i = slot(k); key[i] = k; value[i] = v; }
+};
+
+// Helper function to push a character vector to the Lua stack as a
+// luajr.character vector. This builds the underlying table of strings
+// directly, rather than calling luajr.construct_vec().
+static void push_R_character_v(lua_State* L, SEXP x, R_xlen_t xlen, const Conv* cv)
+{
+    if (xlen >= LJ_MAX_ASIZE)
+        conv_error(L, cv, "Cannot create character vector with more than %d elements. Requested size: %.0f. Use 'r' arg code instead.",
+            LJ_MAX_ASIZE - 1, (double)xlen);
+
+    // The vector is a table { [0] = strings } with the character vector metatable
+    lua_createtable(L, 0, 1);
+    conv_get(L, cv, CONV_CHARACTER_MT);
+    lua_setmetatable(L, -2);
+
+    // Fill the table of strings. Elements with the same CHARSXP are copied
+    // from their first occurrence rather than pushed again.
+    lua_createtable(L, xlen, 0);
+    StringCache<int> cache;
+    conv_materialise(L, x, cv);
+    const SEXP* px = STRING_PTR_RO(x);
+    for (R_xlen_t i = 0; i < xlen; ++i)
+    {
+        SEXP c = px[i];
+        int j;
+        if (cache.get(c, j))
+            lua_rawgeti(L, -1, j);
+        else
+        {
+            if (c == NA_STRING)
+                conv_get(L, cv, CONV_NA_CHARACTER);
+            else
+            {
+                check_string_length(L, c, cv);
+                lua_pushlstring(L, CHAR(c), LENGTH(c));
+            }
+            cache.put(c, i + 1);
+        }
+        lua_rawseti(L, -2, i + 1);
+    }
+    lua_rawseti(L, -2, 0);
+}
+
+// Helper function to convert the luajr.character vector at [index], of
+// length size, to a STRSXP. Repeated Lua strings reuse the same CHARSXP.
+static SEXP character_v_to_sexp(lua_State* L, int index, R_xlen_t size, const Conv* cv)
+{
+    SEXP ret = PROTECT(Rf_allocVector(STRSXP, size));
+
+    lua_rawgeti(L, index, 0);
+    conv_get(L, cv, CONV_NA_CHARACTER);
+
+    StringCache<SEXP> cache;
+    for (R_xlen_t i = 0; i < size; ++i)
+    {
+        lua_rawgeti(L, -2, i + 1);
+        SEXP c;
+        if (lua_type(L, -1) == LUA_TSTRING)
+        {
+            size_t len;
+            const char* str = lua_tolstring(L, -1, &len);
+            if (!cache.get(str, c))
+            {
+                c = Rf_mkCharLen(str, len);
+                cache.put(str, c);
+            }
+        }
+        else if (lua_rawequal(L, -1, -2) || lua_equal(L, -1, -2))
+            c = NA_STRING;
+        else
+        {
+            const char* tname = lua_typename(L, lua_type(L, -1));
+            lua_pop(L, 3);
+            Rf_error("Character vector element %.0f is a %s value.", (double)(i + 1), tname);
+        }
+        SET_STRING_ELT(ret, i, c);
+        lua_pop(L, 1);
+    }
+
+    lua_pop(L, 2);
+    UNPROTECT(1);
+    return ret;
+}
+
+static void push_sexp(lua_State* L, SEXP x, char as, const Conv* cv);
 
 // Helper function to push a vector to the Lua stack.
 template <typename Push>
-static void push_R_vector(lua_State* L, SEXP x, char as, int type, Push push)
+static void push_R_vector(lua_State* L, SEXP x, char as, int type, Push push, const Conv* cv)
 {
     // Get length of vector
     R_xlen_t xlen = Rf_xlength(x);
@@ -28,31 +526,65 @@ static void push_R_vector(lua_State* L, SEXP x, char as, int type, Push push)
     switch (as)
     {
         case 'r':
+            // Logical, integer, and numeric reference types are constructed
+            // directly; character references go through luajr.construct_ref()
+            if (type != CHARACTER_T)
+            {
+                push_R_ref(L, x, type, cv);
+                break;
+            }
+
             // Get luajr.construct_ref() on the stack
-            lua_pushlightuserdata(L, (void*)&luajr_construct_ref);
-            lua_rawget(L, LUA_REGISTRYINDEX);
+            conv_get(L, cv, CONV_CONSTRUCT_REF);
             // Call it with arguments x as userdata, type code as integer
             lua_pushlightuserdata(L, x);
             lua_pushinteger(L, type | REFERENCE_T);
-            luajr_pcall(L, 2, 1, "luajr.construct_ref() from push_R_vector()", LUAJR_TOOLING_NONE);
+            conv_call(L, cv, 2, 1, "luajr.construct_ref() from push_R_vector()");
             break;
 
         case 'v':
+            // Character vectors are constructed directly
+            if (type == CHARACTER_T)
+            {
+                push_R_character_v(L, x, xlen, cv);
+                break;
+            }
+
             // Get luajr.construct_vec() on the stack
-            lua_pushlightuserdata(L, (void*)&luajr_construct_vec);
-            lua_rawget(L, LUA_REGISTRYINDEX);
+            conv_materialise(L, x, cv);
+            conv_get(L, cv, CONV_CONSTRUCT_VEC);
             // Call it with arguments x as userdata, type code as integer
             lua_pushlightuserdata(L, x);
             lua_pushinteger(L, type | VECTOR_T);
-            luajr_pcall(L, 2, 1, "luajr.construct_vec() from push_R_vector()", LUAJR_TOOLING_NONE);
+            conv_call(L, cv, 2, 1, "luajr.construct_vec() from push_R_vector()");
+            break;
+
+        case 'm':
+            // Logical, integer, and numeric matrices as matrix reference types
+            if (type == CHARACTER_T)
+                conv_error(L, cv, "Unrecognised args code %c for type %s.", as, Rf_type2char(TYPEOF(x)));
+            push_R_matrix(L, x, type, cv);
+            break;
+
+        case 'c':
+            // Chunked view of the vector passed by reference
+            conv_get(L, cv, CONV_CHUNKED);
+            push_R_vector(L, x, 'r', type, push, cv);
+            conv_call(L, cv, 1, 1, "luajr.chunked() from push_R_vector()");
             break;
 
         case 's':
         case 'a':
+            // Character vectors are read element by element, so materialise
+            // an ALTREP vector's strings once for all of them
+            if (type == CHARACTER_T && xlen > 0 && xlen < LJ_MAX_ASIZE)
+                conv_materialise(L, x, cv);
             if (xlen == 0)
                 lua_pushnil(L); // Length 0: push nil
             else if (xlen == 1 && as == 's')
                 push(L, x, 0);  // Length 1 and 's': push scalar
+            else if (xlen < LJ_MAX_ASIZE && type != CHARACTER_T)
+                push_R_table(L, x, xlen, type, cv); // Length >1 or 'a': push table
             else if (xlen < LJ_MAX_ASIZE) // Strict < needed here.
             {                   // Length >1 or 'a': push table
                 lua_createtable(L, xlen, 0);
@@ -63,7 +595,7 @@ static void push_R_vector(lua_State* L, SEXP x, char as, int type, Push push)
                 }
             }
             else
-                Rf_error("Cannot create Lua table with more than %d elements. Requested size: %.0f. Use 'r' or 'v' arg code instead.",
+                conv_error(L, cv, "Cannot create Lua table with more than %d elements. Requested size: %.0f. Use 'r', 'v' or 'c' arg code instead.",
                     LJ_MAX_ASIZE - 1, (double)xlen);
             break;
 
@@ -72,22 +604,91 @@ static void push_R_vector(lua_State* L, SEXP x, char as, int type, Push push)
             {
                 int reqn = as - '0';
                 if (xlen != reqn)
-                    Rf_error("Vector of length %d requested, but passed vector of length %.0f.", reqn, (double)xlen);
-                push_R_vector(L, x, 's', type, push);
+                    conv_error(L, cv, "Vector of length %d requested, but passed vector of length %.0f.", reqn, (double)xlen);
+                push_R_vector(L, x, 's', type, push, cv);
                 break;
             }
-            Rf_error("Unrecognised args code %c for type %s.", as, Rf_type2char(TYPEOF(x)));
+            conv_error(L, cv, "Unrecognised args code %c for type %s.", as, Rf_type2char(TYPEOF(x)));
             break;
     }
 }
 
+// Helper function to push a data.frame to the Lua stack as a luajr.list, for
+// arg codes 'r' and 'v'. Unlike other lists, this builds the list directly
+// rather than through luajr.construct_list(), and carries over the data
+// frame's class, plus its row names if they are not automatic. Automatic row
+// names are recreated from the number of rows when the data frame is returned.
+static void push_R_dataframe(lua_State* L, SEXP x, char as, const Conv* cv)
+{
+    int ncol = Rf_length(x);
+    SEXP names = PROTECT(Rf_getAttrib(x, R_NamesSymbol));
+    if (names != R_NilValue && TYPEOF(names) != STRSXP)
+        conv_error(L, cv, "Non-character names attribute on vector.");
+
+    // The list is a table { [0] = contents } with the list metatable
+    lua_createtable(L, 0, 1);
+    conv_get(L, cv, CONV_LIST_MT);
+    lua_setmetatable(L, -2);
+
+    // Contents: columns, then names and other attributes
+    lua_createtable(L, ncol, 3);
+    for (int i = 0; i < ncol; ++i)
+    {
+        push_sexp(L, VECTOR_ELT(x, i), as, cv);
+        lua_rawseti(L, -2, i + 1);
+    }
+
+    // Column name index, e.g. { foo = 1, bar = 2 }
+    lua_createtable(L, 0, ncol);
+    if (names != R_NilValue)
+    {
+        for (int i = 0; i < ncol; ++i)
+        {
+            SEXP name = STRING_ELT(names, i);
+            if (LENGTH(name) > 0)
+            {
+                lua_pushlstring(L, CHAR(name), LENGTH(name));
+                lua_pushinteger(L, i + 1);
+                lua_rawset(L, -3);
+            }
+        }
+    }
+    lua_setfield(L, -2, "names");
+
+    // Class
+    push_sexp(L, Rf_getAttrib(x, R_ClassSymbol), as, cv);
+    lua_setfield(L, -2, "class");
+
+    // Row names, unless they are 1 to nrow. Rf_getAttrib() expands R's
+    // compact representation of automatic row names, c(NA, +/-nrow), into
+    // 1:nrow, so these are recognised by their values.
+    SEXP rownames = PROTECT(conv_getattrib(L, x, R_RowNamesSymbol, cv));
+    bool automatic = TYPEOF(rownames) == INTSXP;
+    if (automatic)
+    {
+        conv_materialise(L, rownames, cv);
+        const int* rn = INTEGER_RO(rownames);
+        const R_xlen_t len = Rf_xlength(rownames);
+        for (R_xlen_t i = 0; i < len && automatic; ++i)
+            automatic = rn[i] == i + 1;
+    }
+    if (!automatic && rownames != R_NilValue)
+    {
+        push_sexp(L, rownames, as, cv);
+        lua_setfield(L, -2, "row.names");
+    }
+
+    lua_rawseti(L, -2, 0);
+    UNPROTECT(2);
+}
+
 // Helper function to push a list to the Lua stack.
-static void push_R_list(lua_State* L, SEXP x, char as)
+static void push_R_list(lua_State* L, SEXP x, char as, const Conv* cv)
 {
     // Get length of vector
     R_xlen_t xlen = Rf_xlength(x);
     if (xlen >= LJ_MAX_ASIZE || xlen >= std::numeric_limits<int>::max())
-        Rf_error("List is too large to be passed to Lua. Cannot create Lua table with more than %d elements. Requested size: %.0f.",
+        conv_error(L, cv, "List is too large to be passed to Lua. Cannot create Lua table with more than %d elements. Requested size: %.0f.",
             LJ_MAX_ASIZE - 1, (double)xlen);
     int len = Rf_length(x);
 
@@ -96,7 +697,7 @@ static void push_R_list(lua_State* L, SEXP x, char as)
     // issuing a false-positive warning.
     SEXP names = PROTECT(Rf_getAttrib(x, R_NamesSymbol));
     if (names != R_NilValue && TYPEOF(names) != STRSXP)
-        Rf_error("Non-character names attribute on vector.");
+        conv_error(L, cv, "Non-character names attribute on vector.");
 
     // Count number of elements with non-empty names
     unsigned int n_named = 0;
@@ -111,9 +712,15 @@ static void push_R_list(lua_State* L, SEXP x, char as)
     {
         case 'r':
         case 'v':
+            // Data frames have their own path
+            if (Rf_inherits(x, "data.frame"))
+            {
+                push_R_dataframe(L, x, as, cv);
+                break;
+            }
+
             // Get luajr.construct_list on the stack
-            lua_pushlightuserdata(L, (void*)&luajr_construct_list);
-            lua_rawget(L, LUA_REGISTRYINDEX);
+            conv_get(L, cv, CONV_CONSTRUCT_LIST);
 
             // Push two arguments for luajr.construct_list:
             // 1. A table containing all elements of the list.
@@ -122,7 +729,7 @@ static void push_R_list(lua_State* L, SEXP x, char as)
             // Add each element to table in turn
             for (int i = 0; i < len; ++i)
             {
-                luajr_pushsexp(L, VECTOR_ELT(x, i), as);
+                push_sexp(L, VECTOR_ELT(x, i), as, cv);
                 lua_rawseti(L, -2, i + 1);
             }
 
@@ -144,7 +751,7 @@ static void push_R_list(lua_State* L, SEXP x, char as)
             }
 
             // Call luajr.construct_list
-            luajr_pcall(L, 2, 1, "luajr.construct_list() from push_R_list()", LUAJR_TOOLING_NONE);
+            conv_call(L, cv, 2, 1, "luajr.construct_list() from push_R_list()");
 
             break;
 
@@ -161,95 +768,173 @@ static void push_R_list(lua_State* L, SEXP x, char as)
                 {
                     // Add string-indexed alias of this element
                     lua_pushstring(L, CHAR(STRING_ELT(names, i)));
-                    luajr_pushsexp(L, VECTOR_ELT(x, i), as);
+                    push_sexp(L, VECTOR_ELT(x, i), as, cv);
                     lua_rawset(L, -3);
                 }
                 else
                 {
                     // Add integer-indexed alias of this element
-                    luajr_pushsexp(L, VECTOR_ELT(x, i), as);
+                    push_sexp(L, VECTOR_ELT(x, i), as, cv);
                     lua_rawseti(L, -2, i + 1);
                 }
             }
             break;
 
         default:
-            Rf_error("Unrecognised args code %c for type %s.", as, Rf_type2char(TYPEOF(x)));
+            conv_error(L, cv, "Unrecognised args code %c for type %s.", as, Rf_type2char(TYPEOF(x)));
             break;
     }
 
     UNPROTECT(1);
 }
 
-// Stop if length of chr exceeds LuaJIT limits.
-void CheckStringLength(SEXP chr)
-{
-    R_xlen_t xlen = Rf_xlength(chr);
-    if (xlen >= LJ_MAX_STR)
-        Rf_error("Cannot pass string with more than %d bytes. Requested size: %.0f.", LJ_MAX_STR, (double)xlen);
-}
-
-// Analogous to Lua's lua_pushXXX(lua_State* L, XXX x) functions, this pushes
-// the R object [x] onto Lua's stack.
-// Supported: NILSXP, LGLSXP, INTSXP, REALSXP, STRSXP, VECSXP, EXTPTRSXP,
-// RAWSXP.
-// Not supported: SYMSXP, LISTSXP, CLOSXP, ENVSXP, PROMSXP, LANGSXP, SPECIALSXP,
-// BUILTINSXP, CHARSXP, CPLXSXP, DOTSXP, ANYSXP, EXPRSXP, BCODESXP, WEAKREFSXP,
-// S4SXP.
-extern "C" void luajr_pushsexp(lua_State* L, SEXP x, char as)
+// Push the R object [x] onto Lua's stack; see luajr_pushsexp().
+static void push_sexp(lua_State* L, SEXP x, char as, const Conv* cv)
 {
     switch (TYPEOF(x))
     {
         case NILSXP: // NULL
             if (as == 'r' || as == 'v')
             {
-                lua_pushlightuserdata(L, (void*)&luajr_construct_null);
-                lua_rawget(L, LUA_REGISTRYINDEX);
-                luajr_pcall(L, 0, 1, "luajr.construct_null() from luajr_pushsexp()", LUAJR_TOOLING_NONE);
+                conv_get(L, cv, CONV_CONSTRUCT_NULL);
+                conv_call(L, cv, 0, 1, "luajr.construct_null() from luajr_pushsexp()");
             }
             else
                 lua_pushnil(L);
             break;
         case LGLSXP: // logical vector: r, v, s, a, 1-9
             push_R_vector(L, x, as, LOGICAL_T,
-                [](lua_State* L, SEXP x, unsigned int i)
-                    { lua_pushboolean(L, LOGICAL_ELT(x, i)); });
+                [cv](lua_State* L, SEXP x, unsigned int i)
+                    { int v; conv_read(L, cv, x, [&] { v = LOGICAL_ELT(x, i); });
+                      lua_pushboolean(L, v); }, cv);
             break;
         case INTSXP: // integer vector: r, v, s, a, 1-9
             push_R_vector(L, x, as, INTEGER_T,
-                [](lua_State* L, SEXP x, unsigned int i)
-                    { lua_pushinteger(L, INTEGER_ELT(x, i)); });
+                [cv](lua_State* L, SEXP x, unsigned int i)
+                    { int v; conv_read(L, cv, x, [&] { v = INTEGER_ELT(x, i); });
+                      lua_pushinteger(L, v); }, cv);
             break;
         case REALSXP: // numeric vector: r, v, s, a, 1-9
             push_R_vector(L, x, as, NUMERIC_T,
-                [](lua_State* L, SEXP x, unsigned int i)
-                    { lua_pushnumber(L, REAL_ELT(x, i)); });
+                [cv](lua_State* L, SEXP x, unsigned int i)
+                    { double v; conv_read(L, cv, x, [&] { v = REAL_ELT(x, i); });
+                      lua_pushnumber(L, v); }, cv);
             break;
         case STRSXP: // character vector: r, v, s, a, 1-9
             push_R_vector(L, x, as, CHARACTER_T,
-                [](lua_State* L, SEXP x, unsigned int i)
-                    { CheckStringLength(STRING_ELT(x, i));
-                      lua_pushstring(L, CHAR(STRING_ELT(x, i))); });
+                [cv](lua_State* L, SEXP x, unsigned int i)
+                    { SEXP c = STRING_ELT(x, i);
+                      check_string_length(L, c, cv);
+                      lua_pushstring(L, CHAR(c)); }, cv);
             break;
         case VECSXP: // list (generic vector): r, v, s
-            push_R_list(L, x, as);
+            push_R_list(L, x, as, cv);
             break;
         case EXTPTRSXP: // external pointer
             lua_pushlightuserdata(L, R_ExternalPtrAddr(x));
             break;
         case RAWSXP: // raw bytes
-            CheckStringLength(x);
+            check_string_length(L, x, cv);
+            conv_materialise(L, x, cv);
             lua_pushlstring(L, (const char*)RAW(x), Rf_length(x));
             break;
         default:
-            Rf_error("Cannot convert %s to Lua.", Rf_type2char(TYPEOF(x)));
+            conv_error(L, cv, "Cannot convert %s to Lua.", Rf_type2char(TYPEOF(x)));
     }
 }
 
-// Analogous to Lua's lua_toXXX(lua_State* L, int index) functions, this gets
-// the value at [index] on the stack as a SEXP that can be handed to R. Note
-// that SEXPs returned from this function need to be protected in calling code.
-extern "C" SEXP luajr_tosexp(lua_State* L, int index)
+// Analogous to Lua's lua_pushXXX(lua_State* L, XXX x) functions, this pushes
+// the R object [x] onto Lua's stack.
+// Supported: NILSXP, LGLSXP, INTSXP, REALSXP, STRSXP, VECSXP, EXTPTRSXP,
+// RAWSXP.
+// Not supported: SYMSXP, LISTSXP, CLOSXP, ENVSXP, PROMSXP, LANGSXP, SPECIALSXP,
+// BUILTINSXP, CHARSXP, CPLXSXP, DOTSXP, ANYSXP, EXPRSXP, BCODESXP, WEAKREFSXP,
+// S4SXP.
+extern "C" void luajr_pushsexp(lua_State* L, SEXP x, char as)
+{
+    push_sexp(L, x, as, 0);
+}
+
+// Helper function to convert the luajr cdata object at [index], with type
+// code [type] (see luajr.ctype_codes), to a SEXP. This reads the reference,
+// vector, or moved vector type's payload directly.
+static SEXP cdata_to_sexp(lua_State* L, int index, int type)
+{
+    const void* payload = lua_topointer(L, index);
+
+    if (type == NULL_T)
+        return R_NilValue;
+    else if (type < VECTOR_T)
+    {
+        // Reference type
+        if (type == CHARACTER_T)
+            return reinterpret_cast<const character_rt*>(payload)->_s;
+        return reinterpret_cast<const numeric_rt*>(payload)->_s; // same layout for all three
+    }
+    else if (type & MATRIX_T)
+    {
+        // Matrix reference type
+        return reinterpret_cast<const numeric_matrix_rt*>(payload)->_s; // same layout for all three
+    }
+    else if (type & MOVED_T)
+    {
+        // Vector moved with luajr.move(): hand its buffer over to R
+        moved_vt* m = const_cast<moved_vt*>(reinterpret_cast<const moved_vt*>(payload));
+        int rtype = NILSXP;
+        if      (m->type == (LOGICAL_T | VECTOR_T | MOVED_T))  rtype = LGLSXP;
+        else if (m->type == (INTEGER_T | VECTOR_T | MOVED_T))  rtype = INTSXP;
+        else if (m->type == (NUMERIC_T | VECTOR_T | MOVED_T))  rtype = REALSXP;
+        else Rf_error("Unknown type");
+
+        SEXP ret = luajr_altrep_vector(&m->p, m->n, rtype);
+        m->n = 0;
+        return ret;
+    }
+    else
+    {
+        // Vector type: copy contents
+        SEXP ret;
+        if (type == (LOGICAL_T | VECTOR_T) || type == (INTEGER_T | VECTOR_T))
+        {
+            const logical_vt* v = reinterpret_cast<const logical_vt*>(payload);
+            ret = Rf_allocVector(type == (LOGICAL_T | VECTOR_T) ? LGLSXP : INTSXP, v->n);
+            if (v->n > 0)
+                std::memcpy(TYPEOF(ret) == LGLSXP ? LOGICAL(ret) : INTEGER(ret),
+                    v->p + 1, sizeof(int) * (R_xlen_t)v->n);
+        }
+        else if (type == (NUMERIC_T | VECTOR_T))
+        {
+            const numeric_vt* v = reinterpret_cast<const numeric_vt*>(payload);
+            ret = Rf_allocVector(REALSXP, v->n);
+            if (v->n > 0)
+                std::memcpy(REAL(ret), v->p + 1, sizeof(double) * (R_xlen_t)v->n);
+        }
+        else
+            Rf_error("Unknown type");
+        return ret;
+    }
+}
+
+// Helper function to identify the luajr cdata type at [index], returning its
+// type code (see luajr.ctype_codes), NULL_T for a null pointer of any type,
+// or -1 if it is not a luajr type.
+static int cdata_type(lua_State* L, int index, const ConvTypes* types)
+{
+    // The CTypeID is in the GCcdata header just before the payload
+    const void* payload = lua_topointer(L, index);
+    CTypeID id = (reinterpret_cast<const GCcdata*>(payload) - 1)->ctypeid;
+    for (int i = 0; i < types->n; ++i)
+        if (types->ctypeid[i] == id)
+            return types->code[i];
+
+    const CType* ct = ctype_raw(ctype_cts(L), id);
+    if (ctype_isptr(ct->info) && *reinterpret_cast<void* const*>(payload) == 0)
+        return NULL_T;
+    return -1;
+}
+
+// Get the value at [index] on the stack as a SEXP; see luajr_tosexp().
+static SEXP to_sexp(lua_State* L, int index, const Conv* cv)
 {
     // Convert index to absolute index
     index = (index > 0 || index <= LUA_REGISTRYINDEX) ? index : lua_gettop(L) + index + 1;
@@ -288,19 +973,32 @@ extern "C" SEXP luajr_tosexp(lua_State* L, int index)
         }
         case LUA_TTABLE:
         {
-            // Get luajr.return_info() on the stack
-            lua_pushlightuserdata(L, (void*)&luajr_return_info);
-            lua_rawget(L, LUA_REGISTRYINDEX);
-
-            // Call it with table arg
-            lua_pushvalue(L, index);
-            luajr_pcall(L, 1, 2, "luajr.return_info() from luajr_tosexp() [1]", LUAJR_TOOLING_NONE);
+            // Identify luajr table types by their metatable
+            const GCtab* mt = tabref(reinterpret_cast<const GCtab*>(lua_topointer(L, index))->metatable);
+            int type = -1;
+            if (mt == cv->types->list_mt)
+                type = LIST_T;
+            else if (mt == cv->types->character_mt)
+                type = CHARACTER_T | VECTOR_T;
+            else if (mt == cv->types->chunked_mt)
+            {
+                // Chunked view: return the vector or reference type it views
+                lua_rawgeti(L, index, 0);
+                SEXP retval = PROTECT(to_sexp(L, lua_gettop(L), cv));
+                lua_pop(L, 1);
+                UNPROTECT(1);
+                return retval;
+            }
 
             // If not a known table type, return normal table
-            if (lua_isnil(L, -2))
+            if (type < 0)
             {
-                // Add each entry to a list
-                lua_pop(L, 2); // clear two return values
+                // Arrays of numbers, booleans, or strings become atomic vectors
+                SEXP vec = table_to_vector(L, index);
+                if (vec)
+                    return vec;
+
+                // Otherwise, add each entry to a list
 
                 // First pass: count table entries of each type.
                 size_t narr = 0, nrec = 0;
@@ -333,7 +1031,7 @@ extern "C" SEXP luajr_tosexp(lua_State* L, int index)
                 lua_pushnil(L);
                 while (lua_next(L, index) != 0)
                 {
-                    SEXP val = PROTECT(luajr_tosexp(L, -1));
+                    SEXP val = PROTECT(to_sexp(L, -1, cv));
                     if (lua_type(L, -2) == LUA_TNUMBER)
                     {
                         SET_VECTOR_ELT(retval, arr_i, val);
@@ -355,10 +1053,11 @@ extern "C" SEXP luajr_tosexp(lua_State* L, int index)
                 return retval;
             }
 
-            // If is a known table type
-            int type = lua_tointeger(L, -2);
-            R_xlen_t size = lua_tonumber(L, -1);
-            lua_pop(L, 2);
+            // If is a known table type, both of which keep their contents in
+            // [0]; get the size from there
+            lua_rawgeti(L, index, 0);
+            R_xlen_t size = lua_objlen(L, -1);
+            lua_pop(L, 1);
 
             // List type
             if (type == LIST_T)
@@ -370,19 +1069,28 @@ extern "C" SEXP luajr_tosexp(lua_State* L, int index)
                 // Add each entry to a list
                 SEXP retval = PROTECT(Rf_allocVector(VECSXP, size));
 
-                // Get the list contents on the stack
                 lua_rawgeti(L, index, 0); // get list[0]
 
-                // Put all entries into the list
+                // Put all list elements into the list
+                for (R_xlen_t i = 0; i < size; ++i)
+                {
+                    lua_rawgeti(L, -1, i + 1);
+                    SEXP val = to_sexp(L, -1, cv);
+                    SET_VECTOR_ELT(retval, i, val);
+                    lua_pop(L, 1);
+                }
+
+                // Set attributes
                 lua_pushnil(L);
                 while (lua_next(L, -2) != 0)
                 {
-                    SEXP val = PROTECT(luajr_tosexp(L, -1));
-                    if (lua_type(L, -2) == LUA_TNUMBER) // List element
+                    if (lua_type(L, -2) == LUA_TNUMBER) // List element, done above
                     {
-                        SET_VECTOR_ELT(retval, lua_tointeger(L, -2) - 1, val);
+                        lua_pop(L, 1);
+                        continue;
                     }
-                    else if (lua_type(L, -2) == LUA_TSTRING) // Attribute
+                    SEXP val = PROTECT(to_sexp(L, -1, cv));
+                    if (lua_type(L, -2) == LUA_TSTRING) // Attribute
                     {
                         const char* attr_name = lua_tostring(L, -2);
                         if (std::strcmp(attr_name, "names") == 0) // Special behaviour for names attribute
@@ -436,23 +1144,10 @@ extern "C" SEXP luajr_tosexp(lua_State* L, int index)
             }
 
             // Other known table type
-            int rtype = NILSXP;
             if (type == (CHARACTER_T | VECTOR_T))
-                rtype = STRSXP;
-            else
-                Rf_error("Unknown type");
+                return character_v_to_sexp(L, index, size, cv);
 
-            SEXP ret = PROTECT(Rf_allocVector(rtype, size));
-            // Now get luajr.return_copy() on the stack
-            lua_pushlightuserdata(L, (void*)&luajr_return_copy);
-            lua_rawget(L, LUA_REGISTRYINDEX);
-            // Call it with cdata arg and pointer
-            lua_pushvalue(L, index);
-            lua_pushlightuserdata(L, ret);
-            luajr_pcall(L, 2, 0, "luajr.return_copy() from luajr_tosexp() [1]", LUAJR_TOOLING_NONE);
-            // Return SEXP
-            UNPROTECT(1);
-            return ret;
+            Rf_error("Unknown type");
         }
         case LUA_TLIGHTUSERDATA:
         case LUA_TUSERDATA:
@@ -470,101 +1165,270 @@ extern "C" SEXP luajr_tosexp(lua_State* L, int index)
         }
         case LUA_TCDATA:
         {
-            // Get luajr.return_info() on the stack
-            lua_pushlightuserdata(L, (void*)&luajr_return_info);
-            lua_rawget(L, LUA_REGISTRYINDEX);
-            // Call it with cdata arg
-            lua_pushvalue(L, index);
-            luajr_pcall(L, 1, 2, "luajr.return_info() from luajr_tosexp() [2]", LUAJR_TOOLING_NONE);
-
             // If not a known cdata type, return external pointer
-            if (lua_isnil(L, -2))
+            int type = cdata_type(L, index, cv->types);
+            if (type < 0)
                 return R_MakeExternalPtr(const_cast<void*>(lua_topointer(L, index)), R_NilValue, R_NilValue);
 
             // If is a known cdata type
-            int type = lua_tointeger(L, -2);
-            if (type < VECTOR_T)
-            {
-                // Reference type
-                lua_pop(L, 2);
-
-                SEXP ret = R_NilValue;
-                // Get luajr.return_copy() on the stack
-                lua_pushlightuserdata(L, (void*)&luajr_return_copy);
-                lua_rawget(L, LUA_REGISTRYINDEX);
-                // Call it with cdata arg and sexp
-                lua_pushvalue(L, index);
-                lua_pushlightuserdata(L, &ret);
-                luajr_pcall(L, 2, 0, "luajr.return_copy() from luajr_tosexp() [2]", LUAJR_TOOLING_NONE);
-                // Return SEXP
-                return ret;
-            }
-            else if (type == NULL_T)
-            {
-                lua_pop(L, 2);
-                return R_NilValue;
-            }
-            else
-            {
-                // Value type
-                R_xlen_t size = lua_tonumber(L, -1);
-                lua_pop(L, 2);
-
-                int rtype = NILSXP;
-                if      (type == (LOGICAL_T | VECTOR_T))    rtype = LGLSXP;
-                else if (type == (INTEGER_T | VECTOR_T))    rtype = INTSXP;
-                else if (type == (NUMERIC_T | VECTOR_T))    rtype = REALSXP;
-                else Rf_error("Unknown type");
-
-                SEXP ret = PROTECT(Rf_allocVector(rtype, size));
-                // Now get luajr.return_copy() on the stack
-                lua_pushlightuserdata(L, (void*)&luajr_return_copy);
-                lua_rawget(L, LUA_REGISTRYINDEX);
-                // Call it with cdata arg and pointer
-                lua_pushvalue(L, index);
-                if      (rtype == LGLSXP)   lua_pushlightuserdata(L, LOGICAL(ret));
-                else if (rtype == INTSXP)   lua_pushlightuserdata(L, INTEGER(ret));
-                else if (rtype == REALSXP)  lua_pushlightuserdata(L, REAL(ret));
-                else Rf_error("Unknown type");
-                luajr_pcall(L, 2, 0, "luajr.return_copy() from luajr_tosexp() [3]", LUAJR_TOOLING_NONE);
-                // Return SEXP
-                UNPROTECT(1);
-                return ret;
-            }
+            return cdata_to_sexp(L, index, type);
         }
         default:
             Rf_error("Unknown return type detected: %d", lua_type(L, index));
     }
 }
 
+// Push the table of helpers onto the stack, and return a conversion context
+// for returning values to R that uses it. The caller should pop the table.
+static Conv conv_return(lua_State* L)
+{
+    lua_pushlightuserdata(L, (void*)&luajr_conv_helpers);
+    lua_rawget(L, LUA_REGISTRYINDEX);
+    lua_rawgeti(L, -1, CONV_TYPES);
+    Conv cv = { lua_gettop(L) - 1, 0,
+        reinterpret_cast<const ConvTypes*>(lua_touserdata(L, -1)) };
+    lua_pop(L, 1);
+    return cv;
+}
+
+// Analogous to Lua's lua_toXXX(lua_State* L, int index) functions, this gets
+// the value at [index] on the stack as a SEXP that can be handed to R. Note
+// that SEXPs returned from this function need to be protected in calling code.
+extern "C" SEXP luajr_tosexp(lua_State* L, int index)
+{
+    index = (index > 0 || index <= LUA_REGISTRYINDEX) ? index : lua_gettop(L) + index + 1;
+    Conv cv = conv_return(L);
+    SEXP retval = to_sexp(L, index, &cv);
+    lua_pop(L, 1);
+    return retval;
+}
+
+// Get the number at [index] on the stack as an R integer in *out, as vapply()
+// would: NaN and luajr.NA_integer_ become NA, and any other value must be a
+// whole number in the range of R integers. Returns zero, leaving *out alone,
+// if the value at [index] is not a number or does not fit. Does not call R,
+// so this can be used from any thread.
+extern "C" int luajr_tointeger(lua_State* L, int index, int* out)
+{
+    if (lua_type(L, index) != LUA_TNUMBER)
+        return 0;
+    double d = lua_tonumber(L, index);
+    if (d != d || d == (double)NA_INTEGER)
+        *out = NA_INTEGER;
+    else if (d >= -(double)INT_MAX && d <= (double)INT_MAX && d == (double)(int)d)
+        *out = (int)d;
+    else
+        return 0;
+    return 1;
+}
+
+// Arguments for pass_batch()
+struct PassBatch
+{
+    SEXP args;
+    const char* acode;
+    unsigned int acode_length;
+    char errbuf[CONV_ERRBUF_SIZE];
+};
+
+// Body of luajr_pass(), run as a protected call. Takes a PassBatch as a light
+// userdata argument and returns the converted arguments. The table of helpers
+// is upvalue 1 (see luajr_conv_register()).
+static int pass_batch(lua_State* L)
+{
+    PassBatch* pb = reinterpret_cast<PassBatch*>(lua_touserdata(L, 1));
+    Conv cv = { lua_upvalueindex(1), pb->errbuf, 0 };
+    int nargs = Rf_length(pb->args);
+    for (int i = 0; i < nargs; ++i)
+        push_sexp(L, VECTOR_ELT(pb->args, i), pb->acode[i % pb->acode_length], &cv);
+    return nargs;
+}
+
+// Create the per-state table of conversion helpers and the closure used by
+// luajr_pass(), and save them to the registry. Called from luajr_newstate(),
+// after the helpers themselves have been registered. Returns nonzero, with
+// nothing registered, if there are too many luajr cdata types.
+extern "C" int luajr_conv_register(lua_State* L)
+{
+    lua_pushlightuserdata(L, (void*)&luajr_conv_helpers);
+    lua_createtable(L, CONV_TYPES, 0);
+    for (int i = 1; i <= CONV_N; ++i)
+    {
+        lua_pushlightuserdata(L, conv_keys[i]);
+        lua_rawget(L, LUA_REGISTRYINDEX);
+        lua_rawseti(L, -2, i);
+    }
+
+    // Cache the luajr types
+    ConvTypes* types = reinterpret_cast<ConvTypes*>(lua_newuserdata(L, sizeof(ConvTypes)));
+    types->n = 0;
+    lua_rawgeti(L, -2, CONV_CTYPE_CODES);
+    lua_pushnil(L);
+    while (lua_next(L, -2) != 0)
+    {
+        if (types->n == ConvTypes::max)
+        {
+            lua_pop(L, 6); // key, value, codes, types, helpers, registry key
+            return 1;
+        }
+        types->ctypeid[types->n] = (CTypeID)lua_tointeger(L, -2);
+        types->code[types->n] = lua_tointeger(L, -1);
+        ++types->n;
+        lua_pop(L, 1);
+    }
+    lua_pop(L, 1);
+    lua_rawgeti(L, -2, CONV_LIST_MT);
+    types->list_mt = reinterpret_cast<const GCtab*>(lua_topointer(L, -1));
+    lua_rawgeti(L, -3, CONV_CHARACTER_MT);
+    types->character_mt = reinterpret_cast<const GCtab*>(lua_topointer(L, -1));
+    lua_rawgeti(L, -4, CONV_CHUNKED_MT);
+    types->chunked_mt = reinterpret_cast<const GCtab*>(lua_topointer(L, -1));
+    lua_pop(L, 3);
+    lua_rawseti(L, -2, CONV_TYPES);
+
+    lua_pushlightuserdata(L, (void*)&luajr_conv_pass);
+    lua_pushvalue(L, -2);
+    lua_pushcclosure(L, pass_batch, 1);
+    lua_rawset(L, LUA_REGISTRYINDEX);
+
+    lua_rawset(L, LUA_REGISTRYINDEX);
+    return 0;
+}
+
+// Can [x] be pushed with args code [as] without calling a luajr helper or
+// raising an error? True for NULL, external pointers, and logical, integer,
+// numeric, and character vectors which become nil or a scalar under [as].
+static bool is_plain_arg(SEXP x, char as)
+{
+    switch (TYPEOF(x))
+    {
+        case NILSXP:
+            return as != 'r' && as != 'v';
+        case EXTPTRSXP:
+            return true;
+        case LGLSXP:
+        case INTSXP:
+        case REALSXP:
+        case STRSXP:
+        {
+            R_xlen_t xlen = XLENGTH(x);
+            bool ok = (as == 's' && xlen <= 1) || (as == '1' && xlen == 1) || (as == 'a' && xlen == 0);
+            if (ok && TYPEOF(x) == STRSXP && xlen == 1)
+                ok = XLENGTH(STRING_ELT(x, 0)) < LJ_MAX_STR;
+            return ok;
+        }
+        default:
+            return false;
+    }
+}
+
 // Take a list of values passed from R and pass them to Lua
 // Specifically, push each of the elements of the list args onto the stack of
-// L, using the args code in acode.
-extern "C" void luajr_pass(lua_State* L, SEXP args, const char* acode)
+// L, using the args code in acode, of length acode_length. If every argument
+// is plain (see is_plain_arg()), as is usual for small Lua functions called
+// many times from R, the arguments are pushed directly. Otherwise, all
+// arguments are converted within a single protected call, rather than one
+// per argument that needs a luajr helper.
+extern "C" void luajr_pass_n(lua_State* L, SEXP args, const char* acode, unsigned int acode_length)
 {
-    unsigned int acode_length = std::strlen(acode);
     if (acode_length == 0)
         Rf_error("Length of args code is zero.");
-    for (int i = 0; i < Rf_length(args); ++i)
-        luajr_pushsexp(L, VECTOR_ELT(args, i), acode[i % acode_length]);
+
+    int nargs = Rf_length(args);
+    bool plain = lua_checkstack(L, nargs);
+    for (int i = 0; plain && i < nargs; ++i)
+        plain = is_plain_arg(VECTOR_ELT(args, i), acode[i % acode_length]);
+    if (plain)
+    {
+        for (int i = 0; i < nargs; ++i)
+            push_sexp(L, VECTOR_ELT(args, i), acode[i % acode_length], 0);
+        return;
+    }
+
+    PassBatch pb;
+    pb.args = args;
+    pb.acode = acode;
+    pb.acode_length = acode_length;
+    pb.errbuf[0] = 0;
+    lua_pushlightuserdata(L, (void*)&luajr_conv_pass);
+    lua_rawget(L, LUA_REGISTRYINDEX);
+    lua_pushlightuserdata(L, &pb);
+    int err = lua_pcall(L, 1, Rf_length(args), 0);
+
+    // Errors from the conversion itself are reported as they would be outside
+    // of the protected call; others come from the luajr helpers.
+    if (err && pb.errbuf[0])
+    {
+        lua_pop(L, 1);
+        Rf_error("%s", pb.errbuf);
+    }
+    luajr_handle_lua_error(L, err, "luajr_pass()", 0);
+}
+
+// Take a list of vectors and lists passed from R and pass element i of each
+// to Lua, for one call of a vectorised call (see luajr_stub_vcall()). Each
+// vector or list, none of which may be empty, is recycled to cover i. An
+// element of a logical, integer, numeric, or character vector is pushed as a
+// Lua primitive, as for a vector of length one with args code 's'; an element
+// of a list is pushed using the args code in acode, of length acode_length.
+extern "C" void luajr_pass_at(lua_State* L, SEXP args, R_xlen_t i, const char* acode, unsigned int acode_length)
+{
+    int nargs = Rf_length(args);
+    if (!lua_checkstack(L, nargs))
+        Rf_error("Cannot pass %d arguments to Lua.", nargs);
+
+    for (int j = 0; j < nargs; ++j)
+    {
+        SEXP x = VECTOR_ELT(args, j);
+        R_xlen_t k = i % XLENGTH(x);
+        switch (TYPEOF(x))
+        {
+            case LGLSXP:
+                lua_pushboolean(L, LOGICAL_ELT(x, k));
+                break;
+            case INTSXP:
+                lua_pushinteger(L, INTEGER_ELT(x, k));
+                break;
+            case REALSXP:
+                lua_pushnumber(L, REAL_ELT(x, k));
+                break;
+            case STRSXP:
+                check_string_length(L, STRING_ELT(x, k), 0);
+                lua_pushstring(L, CHAR(STRING_ELT(x, k)));
+                break;
+            case VECSXP:
+                push_sexp(L, VECTOR_ELT(x, k), acode[j % acode_length], 0);
+                break;
+            default:
+                Rf_error("Cannot convert %s to Lua.", Rf_type2char(TYPEOF(x)));
+        }
+    }
+}
+
+// As luajr_pass_n(), for a null-terminated args code.
+extern "C" void luajr_pass(lua_State* L, SEXP args, const char* acode)
+{
+    luajr_pass_n(L, args, acode, std::strlen(acode));
 }
 
 // Take values returned from Lua and return them to R
 // Specifically, take nret values off the stack of L and wrap them in the
 // returned SEXP (either NULL when nret = 0, a single value when nret = 1, or a
-// list when nret > 1).
+// list when nret > 1). The table of helpers is looked up once for all values.
 extern "C" SEXP luajr_return(lua_State* L, int nret)
 {
     // No return value: return NULL
     if (nret == 0)
-    {
         return R_NilValue;
-    }
-    else if (nret == 1)
+
+    // Get the table of helpers on the stack, above the values
+    Conv cv = conv_return(L);
+
+    if (nret == 1)
     {
         // One return value: convert to SEXP, pop, and return
-        SEXP retval = PROTECT(luajr_tosexp(L, -1));
-        lua_pop(L, 1);
+        SEXP retval = PROTECT(to_sexp(L, -2, &cv));
+        lua_pop(L, 2);
         UNPROTECT(1);
         return retval;
     }
@@ -576,12 +1440,12 @@ extern "C" SEXP luajr_return(lua_State* L, int nret)
         // Add elements to table
         for (int i = 0; i < nret; ++i)
         {
-            SEXP v = PROTECT(luajr_tosexp(L, -nret + i));
+            SEXP v = PROTECT(to_sexp(L, -nret - 1 + i, &cv));
             SET_VECTOR_ELT(retlist, i, v);
         }
 
         // Pop and return
-        lua_pop(L, nret);
+        lua_pop(L, nret + 1);
         UNPROTECT(1 + nret);
         return retlist;
     }
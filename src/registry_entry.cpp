@@ -1,11 +1,54 @@
 #include "registry_entry.h"
+#include <map>
+#include <vector>
 extern "C" {
 #include "lua.h"
+#include "lauxlib.h"
 }
 #define R_NO_REMAP
 #include <R.h>
 #include <Rinternals.h>
 
+// Busy Lua states (see SetBusy()), each with the registry slots and keys of
+// the entries deleted while the state was busy. Only accessed from the main
+// thread, which is where entries are created, used, and finalized.
+static std::map<lua_State*, std::vector<std::pair<int, void*>>> busy_states;
+
+// Free registry slot ref and forget the entry with key key in state L.
+static void release_entry(lua_State* L, int ref, void* key)
+{
+    luaL_unref(L, LUA_REGISTRYINDEX, ref);          // Free registry slot
+    lua_getfield(L, LUA_REGISTRYINDEX, "luajrx");   // Get luajrx table from registry on stack
+    lua_pushlightuserdata(L, key);                  // Push key to stack
+    lua_pushnil(L);                                 // Push nil to stack
+    lua_rawset(L, -3);                              // Erase entry in luajrx table; pops key & nil
+    lua_pop(L, 1);                                  // Pop luajrx
+}
+
+// Mark Lua state L as busy or no longer busy.
+void RegistryEntry::SetBusy(lua_State* L, bool busy)
+{
+    if (busy)
+    {
+        busy_states[L];
+        return;
+    }
+
+    auto it = busy_states.find(L);
+    if (it == busy_states.end())
+        return;
+    for (auto& d : it->second)
+        release_entry(L, d.first, d.second);
+    busy_states.erase(it);
+}
+
+// Stop with an error if Lua state L is busy.
+void RegistryEntry::CheckNotBusy(lua_State* L)
+{
+    if (!busy_states.empty() && busy_states.count(L))
+        Rf_error("Cannot use a Lua state which is in use by an asynchronous lua_parallel job.");
+}
+
 // Disarm all RegistryEntries within Lua state L.
 void RegistryEntry::DisarmAll(lua_State* L)
 {
@@ -20,6 +63,7 @@ void RegistryEntry::DisarmAll(lua_State* L)
         re->l = 0;
         lua_pop(L, 1);
     }
+    lua_pop(L, 1);                                  // Pop luajrx
 }
 
 // Destroy a registry entry pointed to by an R external pointer when it is no
@@ -31,14 +75,18 @@ void RegistryEntry::Finalize(SEXP xptr)
 }
 
 // Create a registry entry, registering and popping the value at the top of the stack.
+// The value itself is held in an integer slot of the registry, so that it can
+// be retrieved with a single lua_rawgeti(); the luajrx table keeps track of
+// all live entries, keyed by their address, so that they can be disarmed when
+// the state is closed.
 RegistryEntry::RegistryEntry(lua_State* L)
  : l(L)
 {
+    ref = luaL_ref(l, LUA_REGISTRYINDEX);           // Register value; pops value
     lua_getfield(l, LUA_REGISTRYINDEX, "luajrx");   // Get luajrx table from registry on stack
-    lua_insert(l, -2);                              // Move luajrx table below value
-    lua_pushlightuserdata(l, (void*)this);          // Push registry key to stack
-    lua_insert(l, -2);                              // Move registry key below value on stack
-    lua_rawset(l, -3);                              // Set value in luajrx table; pops key & value
+    lua_pushlightuserdata(l, (void*)this);          // Push key to stack
+    lua_pushboolean(l, 1);                          // Push true to stack
+    lua_rawset(l, -3);                              // Record entry in luajrx table; pops key & true
     lua_pop(l, 1);                                  // Pop luajrx
 }
 
@@ -46,21 +94,24 @@ RegistryEntry::RegistryEntry(lua_State* L)
 RegistryEntry::~RegistryEntry()
 {
     if (l == 0) return;
-    lua_getfield(l, LUA_REGISTRYINDEX, "luajrx");   // Get luajrx table from registry on stack
-    lua_pushlightuserdata(l, (void*)this);          // Push registry key to stack
-    lua_pushnil(l);                                 // Push nil to stack
-    lua_rawset(l, -3);                              // Erase value in luajrx table; pops key & nil
-    lua_pop(l, 1);                                  // Pop luajrx
+    if (!busy_states.empty())
+    {
+        auto it = busy_states.find(l);
+        if (it != busy_states.end())
+        {
+            it->second.emplace_back(ref, (void*)this);
+            return;
+        }
+    }
+    release_entry(l, ref, (void*)this);
 }
 
 // Put the registered value at the top of the stack.
 void RegistryEntry::Get()
 {
     if (l == 0) { Rf_error("Invalid registry entry retrieval: Lua state closed."); return; }
-    lua_getfield(l, LUA_REGISTRYINDEX, "luajrx");   // Get luajrx table from registry on stack
-    lua_pushlightuserdata(l, (void*)this);          // Push registry key to stack
-    lua_rawget(l, -2);                              // Get value on stack
-    lua_remove(l, -2);                              // Remove luajrx table from stack
+    CheckNotBusy(l);
+    lua_rawgeti(l, LUA_REGISTRYINDEX, ref);         // Get value on stack
 }
 
 // Get the associated Lua state.
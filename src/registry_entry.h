@@ -17,6 +17,15 @@ public:
     // Disarm all RegistryEntries within Lua state L.
     static void DisarmAll(lua_State* L);
 
+    // Mark Lua state L as busy (in use by worker threads) or no longer busy.
+    // While L is busy, Get() stops with an error, and registry entries in L
+    // which are deleted have their slots freed only once L is no longer busy.
+    // Only to be called from the main thread.
+    static void SetBusy(lua_State* L, bool busy);
+
+    // Stop with an error if Lua state L is busy.
+    static void CheckNotBusy(lua_State* L);
+
     // Destroy a registry entry pointed to by an R external pointer when it is no
     // longer needed (i.e. at program exit or garbage collection of the R pointer).
     static void Finalize(SEXP xptr);
@@ -44,6 +53,7 @@ public:
 
 private:
     lua_State* l; // lua_State in which registry is stored
+    int ref;      // Slot in registry holding the value
 };
 
 #endif // REGISTRY_ENTRY_H
@@ -5,6 +5,7 @@
 #include "shared.h"
 #include "registry_entry.h"
 #include <string>
+#include <cstring>
 extern "C" {
 #include "lua.h"
 #include "lauxlib.h"
@@ -115,6 +116,224 @@ extern "C" SEXP luajr_func_call(SEXP fx, SEXP alist, SEXP acode, SEXP Lx)
     return luajr_return(L, top1 - top0);
 }
 
+// A call stub for a Lua function, made once by luajr_func_stub() so that each
+// call from R through luajr_stub_call() does as little work as possible: the
+// function's registry entry is looked up, and the args code measured, only
+// once, and the Lua state is the one the function belongs to.
+struct FuncStub
+{
+    RegistryEntry* re;
+    std::string acode;
+};
+
+// Destroy a FuncStub pointed to by an R external pointer when it is no longer
+// needed. The registry entry itself belongs to the function's own external
+// pointer, which the stub's pointer keeps alive.
+static void finalize_func_stub(SEXP xptr)
+{
+    delete reinterpret_cast<FuncStub*>(R_ExternalPtrAddr(xptr));
+    R_ClearExternalPtr(xptr);
+}
+
+// Make a call stub for the Lua function fx (as returned by luajr_func_create)
+// with args code acode.
+extern "C" SEXP luajr_func_stub(SEXP fx, SEXP acode)
+{
+    CheckSEXPLen(acode, STRSXP, 1);
+
+    RegistryEntry* re = reinterpret_cast<RegistryEntry*>(luajr_getpointer(fx, LUAJR_REGFUNC_CODE));
+    if (!re)
+        Rf_error("luajr_func_stub expects a valid registry entry.");
+    if (Rf_length(STRING_ELT(acode, 0)) == 0)
+        Rf_error("Length of args code is zero.");
+
+    FuncStub* fs = new FuncStub { re, CHAR(STRING_ELT(acode, 0)) };
+    SEXP stub = PROTECT(luajr_makepointer(fs, LUAJR_FUNCSTUB_CODE, finalize_func_stub));
+    R_SetExternalPtrProtected(stub, fx);
+    UNPROTECT(1);
+    return stub;
+}
+
+// Call a Lua function through its call stub
+extern "C" SEXP luajr_stub_call(SEXP stub, SEXP alist)
+{
+    CheckSEXP(alist, VECSXP);
+
+    FuncStub* fs = reinterpret_cast<FuncStub*>(luajr_getpointer(stub, LUAJR_FUNCSTUB_CODE));
+    if (!fs)
+        Rf_error("luajr_stub_call expects a valid call stub.");
+    lua_State* L = fs->re->GetState();
+    if (!L)
+        Rf_error("Invalid registry entry retrieval: Lua state closed.");
+    RegistryEntry::CheckNotBusy(L);
+
+    // Assemble function call
+    int top0 = lua_gettop(L);
+    fs->re->Get();
+    luajr_pass_n(L, alist, fs->acode.data(), fs->acode.size());
+
+    // Call function
+    luajr_pcall(L, Rf_length(alist), LUA_MULTRET, "user function from luajr_stub_call()", LUAJR_TOOLING_ALL);
+    int top1 = lua_gettop(L);
+
+    // Return results
+    return luajr_return(L, top1 - top0);
+}
+
+// Write the Lua value on the top of the stack of L to element i of result, a
+// logical, integer, numeric, or character vector, returning false if it is
+// not of a suitable type: a boolean, a whole number in range (see
+// luajr_tointeger), a number, or a string without embedded nulls,
+// respectively. nil becomes NA.
+static bool vcall_store(lua_State* L, SEXP result, R_xlen_t i)
+{
+    int type = lua_type(L, -1);
+    switch (TYPEOF(result))
+    {
+        case REALSXP:
+            if (type == LUA_TNUMBER)
+                REAL(result)[i] = lua_tonumber(L, -1);
+            else if (type == LUA_TNIL)
+                REAL(result)[i] = NA_REAL;
+            else
+                return false;
+            break;
+
+        case INTSXP:
+            if (type == LUA_TNIL)
+                INTEGER(result)[i] = NA_INTEGER;
+            else if (!luajr_tointeger(L, -1, INTEGER(result) + i))
+                return false;
+            break;
+
+        case LGLSXP:
+            if (type == LUA_TBOOLEAN)
+                LOGICAL(result)[i] = lua_toboolean(L, -1);
+            else if (type == LUA_TNIL)
+                LOGICAL(result)[i] = NA_LOGICAL;
+            else
+                return false;
+            break;
+
+        case STRSXP:
+            if (type == LUA_TSTRING)
+            {
+                size_t len;
+                const char* str = lua_tolstring(L, -1, &len);
+                if (std::strlen(str) != len) // embedded nulls
+                    return false;
+                SET_STRING_ELT(result, i, Rf_mkCharLen(str, len));
+            }
+            else if (type == LUA_TNIL)
+                SET_STRING_ELT(result, i, NA_STRING);
+            else
+                return false;
+            break;
+    }
+    return true;
+}
+
+// Call a Lua function through its call stub once for each set of arguments in
+// alist, a list of vectors and lists which are recycled to a common length, as
+// with mapply(). The whole loop runs here, keeping the function on the stack
+// of its Lua state throughout. If fun_value is NULL, the results are returned
+// in a list; otherwise, each result is written straight into a preallocated
+// vector of the same type as fun_value, which must have length 1.
+extern "C" SEXP luajr_stub_vcall(SEXP stub, SEXP alist, SEXP fun_value)
+{
+    CheckSEXP(alist, VECSXP);
+
+    FuncStub* fs = reinterpret_cast<FuncStub*>(luajr_getpointer(stub, LUAJR_FUNCSTUB_CODE));
+    if (!fs)
+        Rf_error("luajr_stub_vcall expects a valid call stub.");
+    lua_State* L = fs->re->GetState();
+    if (!L)
+        Rf_error("Invalid registry entry retrieval: Lua state closed.");
+    RegistryEntry::CheckNotBusy(L);
+
+    // Check arguments and get the number of calls
+    int nargs = Rf_length(alist);
+    R_xlen_t n = 0;
+    for (int j = 0; j < nargs; ++j)
+    {
+        SEXP x = VECTOR_ELT(alist, j);
+        switch (TYPEOF(x))
+        {
+            case NILSXP: case LGLSXP: case INTSXP: case REALSXP: case STRSXP: case VECSXP:
+                break;
+            default:
+                Rf_error("lua_vcall does not support arguments of type %s.", Rf_type2char(TYPEOF(x)));
+        }
+        if (Rf_xlength(x) > n)
+            n = Rf_xlength(x);
+    }
+    bool ragged = false;
+    for (int j = 0; j < nargs && n > 0; ++j)
+    {
+        R_xlen_t xlen = Rf_xlength(VECTOR_ELT(alist, j));
+        if (xlen == 0)
+            Rf_error("lua_vcall cannot mix arguments of length zero with longer arguments.");
+        ragged = ragged || n % xlen != 0;
+    }
+    if (ragged)
+        Rf_warning("Longer argument not a multiple of length of shorter.");
+
+    // Preallocate result
+    bool typed = fun_value != R_NilValue;
+    if (typed)
+    {
+        int type = TYPEOF(fun_value);
+        if ((type != LGLSXP && type != INTSXP && type != REALSXP && type != STRSXP) || Rf_length(fun_value) != 1)
+            Rf_error("FUN.VALUE must be a logical, integer, numeric, or character vector of length 1.");
+    }
+    SEXP result = PROTECT(Rf_allocVector(typed ? TYPEOF(fun_value) : VECSXP, n));
+
+    // Make each call, with the function kept at stack index top0 + 1
+    const char* what = "user function from lua_vcall()";
+    int top0 = lua_gettop(L);
+    fs->re->Get();
+    for (R_xlen_t i = 0; i < n; ++i)
+    {
+        // Check for user interrupt now and then, with a clean stack
+        if (i % 1024 == 1023)
+        {
+            lua_settop(L, top0);
+            R_CheckUserInterrupt();
+            fs->re->Get();
+        }
+
+        lua_pushvalue(L, top0 + 1);
+        luajr_pass_at(L, alist, i, fs->acode.data(), fs->acode.size());
+        int err = luajr_pcall(L, nargs, typed ? 1 : LUA_MULTRET, what,
+            LUAJR_TOOLING_ALL | LUAJR_NO_ERROR_HANDLING);
+        if (err)
+        {
+            lua_remove(L, top0 + 1);
+            luajr_handle_lua_error(L, err, what, 0);
+        }
+
+        if (typed)
+        {
+            if (!vcall_store(L, result, i))
+            {
+                lua_settop(L, top0);
+                Rf_error("lua_vcall expects `func' to return %s (or nil) for call %.0f, as given by FUN.VALUE.",
+                    TYPEOF(result) == REALSXP ? "a number" : TYPEOF(result) == INTSXP ? "an integer" :
+                    TYPEOF(result) == LGLSXP ? "a boolean" : "a string", (double)i + 1);
+            }
+            lua_pop(L, 1);
+        }
+        else
+        {
+            SET_VECTOR_ELT(result, i, luajr_return(L, lua_gettop(L) - (top0 + 1)));
+        }
+    }
+    lua_settop(L, top0);
+
+    UNPROTECT(1);
+    return result;
+}
+
 // Get a luajr function on the stack of the lua_State associated with the luajr function
 extern "C" void luajr_pushfunc(SEXP fx)
 {
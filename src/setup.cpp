@@ -28,10 +28,19 @@ static const R_CallMethodDef CallEntries[] =
     { "_luajr_run_file",        (DL_FUNC)&luajr_run_file,        2 },
     { "_luajr_func_create",     (DL_FUNC)&luajr_func_create,     2 },
     { "_luajr_func_call",       (DL_FUNC)&luajr_func_call,       4 },
+    { "_luajr_func_stub",       (DL_FUNC)&luajr_func_stub,       2 },
+    { "_luajr_stub_call",       (DL_FUNC)&luajr_stub_call,       2 },
+    { "_luajr_stub_vcall",      (DL_FUNC)&luajr_stub_vcall,      3 },
     { "_luajr_module_load",     (DL_FUNC)&luajr_module_load,     2 },
     { "_luajr_module_get",      (DL_FUNC)&luajr_module_get,      3 },
     { "_luajr_module_set",      (DL_FUNC)&luajr_module_set,      4 },
     { "_luajr_run_parallel",    (DL_FUNC)&luajr_run_parallel,    4 },
+    { "_luajr_parallel",        (DL_FUNC)&luajr_parallel,        11 },
+    { "_luajr_parallel_map",    (DL_FUNC)&luajr_parallel_map,    10 },
+    { "_luajr_pool_create",     (DL_FUNC)&luajr_pool_create,     3 },
+    { "_luajr_job_poll",        (DL_FUNC)&luajr_job_poll,        1 },
+    { "_luajr_job_wait",        (DL_FUNC)&luajr_job_wait,        2 },
+    { "_luajr_job_cancel",      (DL_FUNC)&luajr_job_cancel,      1 },
     { "_luajr_profile_data",    (DL_FUNC)&luajr_profile_data,    1 },
     { "_luajr_set_mode",        (DL_FUNC)&luajr_set_mode,        3 },
     { "_luajr_get_mode",        (DL_FUNC)&luajr_get_mode,        0 },
@@ -52,6 +61,9 @@ extern "C" void R_init_luajr(DllInfo *dll)
     R_RegisterCCallable("luajr", #func_name, reinterpret_cast<DL_FUNC>(func_name));
 #include "../inst/include/luajr_funcs.h"
 #undef API_FUNCTION
+
+    // Register ALTREP classes for vectors moved from Lua with luajr.move()
+    luajr_init_altrep(dll);
 }
 
 // Helper to make an external pointer handle
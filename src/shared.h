@@ -1,7 +1,14 @@
 // Forward declarations
+#include <cstddef>
+#include <Rconfig.h>
 struct lua_State;
 struct SEXPREC;
 typedef SEXPREC* SEXP;
+#if SIZEOF_SIZE_T > 4 // As in Rinternals.h
+typedef std::ptrdiff_t R_xlen_t;
+#else
+typedef int R_xlen_t;
+#endif
 
 // The shared global Lua state
 extern lua_State* L0;
@@ -11,8 +18,46 @@ extern int luajr_construct_ref;
 extern int luajr_construct_vec;
 extern int luajr_construct_list;
 extern int luajr_construct_null;
-extern int luajr_return_info;
-extern int luajr_return_copy;
+extern int luajr_ffi_new;
+extern int luajr_logical_r;
+extern int luajr_integer_r;
+extern int luajr_numeric_r;
+extern int luajr_logical_matrix_r;
+extern int luajr_integer_matrix_r;
+extern int luajr_numeric_matrix_r;
+extern int luajr_na_character;
+extern int luajr_character_mt;
+extern int luajr_list_mt;
+extern int luajr_chunked;
+extern int luajr_chunked_mt;
+extern int luajr_ctype_codes;
+extern int luajr_conv_helpers;
+extern int luajr_conv_pass;
+extern int luajr_map_slicer;
+
+// Reference types (see also lua_api.cpp and luajr.lua)
+typedef struct { int* _p;    SEXP _s; } logical_rt;
+typedef struct { int* _p;    SEXP _s; } integer_rt;
+typedef struct { double* _p; SEXP _s; } numeric_rt;
+typedef struct { SEXP _s; } character_rt;
+
+// Matrix reference types (see also lua_api.cpp and luajr.lua)
+typedef struct { int* _p;    SEXP _s; int nrow; int ncol; } logical_matrix_rt;
+typedef struct { int* _p;    SEXP _s; int nrow; int ncol; } integer_matrix_rt;
+typedef struct { double* _p; SEXP _s; int nrow; int ncol; } numeric_matrix_rt;
+
+// Vector types (see also lua_api.cpp and luajr.lua)
+typedef struct { int* p;    double n; double c; SEXP _s; } logical_vt;
+typedef struct { int* p;    double n; double c; SEXP _s; } integer_vt;
+typedef struct { double* p; double n; double c; SEXP _s; } numeric_vt;
+// Character vector is defined in luajr.lua as a table
+
+// Moved vector type (see also luajr.lua): returned by luajr.move(), owns the
+// malloc'd buffer p of n elements until it is handed over to R.
+typedef struct { void* p; double n; int type; } moved_vt;
+
+// DllInfo forward declaration, for initializing ALTREP classes
+struct _DllInfo;
 
 // We declare all functions to have C linkage to avoid name mangling and allow
 // the use of the package functions from C code. This file (shared.h) is only
@@ -29,13 +74,20 @@ SEXP luajr_locate_debugger(SEXP path);  // Not in public API
 SEXP luajr_open();
 SEXP luajr_reset();
 lua_State* luajr_newstate();
+lua_State* luajr_trynewstate(char* buf); // Not in public API
 lua_State* luajr_getstate(SEXP Lx);
 
 // Move values between R and Lua (push_to.cpp)
 void luajr_pushsexp(lua_State* L, SEXP x, char as);
 SEXP luajr_tosexp(lua_State* L, int index);
 void luajr_pass(lua_State* L, SEXP args, const char* acode);
+void luajr_pass_n(lua_State* L, SEXP args, const char* acode,
+    unsigned int acode_length);             // Not in public API
+void luajr_pass_at(lua_State* L, SEXP args, R_xlen_t i, const char* acode,
+    unsigned int acode_length);             // Not in public API
 SEXP luajr_return(lua_State* L, int nret);
+int luajr_tointeger(lua_State* L, int index, int* out); // Not in public API
+int luajr_conv_register(lua_State* L);      // Not in public API
 
 // Run Lua code and functions (run_func.cpp)
 SEXP luajr_run_code(SEXP code, SEXP Lx);
@@ -43,6 +95,10 @@ SEXP luajr_run_file(SEXP filename, SEXP Lx);
 SEXP luajr_func_create(SEXP func, SEXP Lx);
 SEXP luajr_func_call(SEXP fx, SEXP alist, SEXP acode, SEXP Lx);
 void luajr_pushfunc(SEXP fx);
+SEXP luajr_func_stub(SEXP fx, SEXP acode);  // Not in public API
+SEXP luajr_stub_call(SEXP stub, SEXP alist);// Not in public API
+SEXP luajr_stub_vcall(SEXP stub, SEXP alist,
+    SEXP fun_value);                        // Not in public API
 
 // Load and access Lua modules (module.cpp)
 SEXP luajr_module_load(SEXP filename, SEXP Lx);
@@ -51,6 +107,17 @@ SEXP luajr_module_set(SEXP module, SEXP keys, SEXP as, SEXP value);
 
 // Run Lua code in parallel (parallel.cpp)
 SEXP luajr_run_parallel(SEXP func, SEXP n, SEXP threads, SEXP pre);
+SEXP luajr_parallel(SEXP func, SEXP n, SEXP threads, SEXP pre,
+    SEXP schedule, SEXP chunk, SEXP range, SEXP fun_value,
+    SEXP reduce, SEXP async, SEXP timeout);   // Not in public API
+SEXP luajr_parallel_map(SEXP func, SEXP X, SEXP threads, SEXP pre,
+    SEXP schedule, SEXP chunk, SEXP fun_value,
+    SEXP reduce, SEXP async, SEXP timeout);   // Not in public API
+SEXP luajr_pool_create(SEXP n, SEXP pre,
+    SEXP affinity);                           // Not in public API
+SEXP luajr_job_poll(SEXP job);                // Not in public API
+SEXP luajr_job_wait(SEXP job, SEXP timeout);  // Not in public API
+SEXP luajr_job_cancel(SEXP job);              // Not in public API
 
 // Load and call Lua code, and control tooling (tools.cpp)
 void luajr_loadstring(lua_State* L, const char* str);
@@ -73,16 +140,30 @@ void* luajr_getpointer(SEXP x, int tag_code);
 int luajr_handle_lua_error(lua_State* L, int err, const char* what, char* buf); // Not in public API
 SEXP luajr_readline(SEXP prompt);   // Not in public API
 
+// ALTREP classes (altrep.cpp)
+void luajr_init_altrep(struct _DllInfo* dll);               // Not in public API
+SEXP luajr_altrep_vector(void** data, double n, int rtype); // Not in public API
+
 // Access to Lua C API (lua_internal.cpp)
 SEXP luajr_lua_gettop(SEXP Lx);     // Not in public API
 
+// FFI API also used from C++ (lua_api.cpp). Not in public API.
+void SetLogicalRef(logical_rt* x, SEXP s);
+void SetIntegerRef(integer_rt* x, SEXP s);
+void SetNumericRef(numeric_rt* x, SEXP s);
+void SetLogicalMatrixRef(logical_matrix_rt* x, SEXP s);
+void SetIntegerMatrixRef(integer_matrix_rt* x, SEXP s);
+void SetNumericMatrixRef(numeric_matrix_rt* x, SEXP s);
+void luajr_release_pending();   // Release R objects let go of by other threads
+
 } // end of extern "C"
 
 // Type codes, for use with the Lua FFI
 enum
 {
     LOGICAL_T = 0, INTEGER_T = 1, NUMERIC_T = 2, CHARACTER_T = 3,
-    REFERENCE_T = 0, VECTOR_T = 4, LIST_T = 8, NULL_T = 16,
+    REFERENCE_T = 0, VECTOR_T = 4, LIST_T = 8, NULL_T = 16, MOVED_T = 32,
+    MATRIX_T = 64,
 };
 
 // External pointer code tags, for use with luajr_makepointer and luajr_getpointer
@@ -95,7 +176,16 @@ enum
     LUAJR_STATE_CODE = 0x7CA57A7E,
 
     // For luajr_module
-    LUAJR_MODULE_CODE = 0x7CA1110D
+    LUAJR_MODULE_CODE = 0x7CA1110D,
+
+    // For luajr_pool_create and lua_parallel's use of worker pools
+    LUAJR_POOL_CODE = 0x7CA9001E,
+
+    // For asynchronous lua_parallel jobs
+    LUAJR_JOB_CODE = 0x7CA10B5E,
+
+    // For lua_func's call stubs
+    LUAJR_FUNCSTUB_CODE = 0x7CA5705B
 };
 
 
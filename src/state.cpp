@@ -1,5 +1,6 @@
 #include "shared.h"
 #include "registry_entry.h"
+#include <mutex>
 #include <string>
 extern "C" {
 #include "lua.h"
@@ -15,10 +16,24 @@ int luajr_construct_ref = 0;
 int luajr_construct_vec = 0;
 int luajr_construct_list = 0;
 int luajr_construct_null = 0;
-int luajr_return_info = 0;
-int luajr_return_copy = 0;
+int luajr_ffi_new = 0;
+int luajr_logical_r = 0;
+int luajr_integer_r = 0;
+int luajr_numeric_r = 0;
+int luajr_logical_matrix_r = 0;
+int luajr_integer_matrix_r = 0;
+int luajr_numeric_matrix_r = 0;
+int luajr_na_character = 0;
+int luajr_character_mt = 0;
+int luajr_list_mt = 0;
+int luajr_chunked = 0;
+int luajr_chunked_mt = 0;
+int luajr_ctype_codes = 0;
+int luajr_conv_helpers = 0;
+int luajr_conv_pass = 0;
+int luajr_map_slicer = 0;
 
-// luajr module functions to register
+// luajr module functions and types to register
 struct RegistryFunc { void* key; const char* name; };
 static const RegistryFunc luajr_registry_funcs[] =
 {
@@ -26,8 +41,16 @@ static const RegistryFunc luajr_registry_funcs[] =
     { (void*)&luajr_construct_vec,  "construct_vec" },
     { (void*)&luajr_construct_list, "construct_list" },
     { (void*)&luajr_construct_null, "construct_null" },
-    { (void*)&luajr_return_info,    "return_info" },
-    { (void*)&luajr_return_copy,    "return_copy" },
+    { (void*)&luajr_chunked,        "chunked" },
+    { (void*)&luajr_logical_r,      "logical_r" },
+    { (void*)&luajr_integer_r,      "integer_r" },
+    { (void*)&luajr_numeric_r,      "numeric_r" },
+    { (void*)&luajr_logical_matrix_r, "logical_matrix_r" },
+    { (void*)&luajr_integer_matrix_r, "integer_matrix_r" },
+    { (void*)&luajr_numeric_matrix_r, "numeric_matrix_r" },
+    { (void*)&luajr_na_character,   "NA_character_" },
+    { (void*)&luajr_ctype_codes,    "ctype_codes" },
+    { (void*)&luajr_map_slicer,     "map_slicer" },
     { 0, 0 }
 };
 
@@ -37,8 +60,10 @@ static std::string luajr_dylib_path;
 // Path to luajr module source
 static std::string luajr_module_path;
 
-// Bytecode for luajr module
+// Bytecode for luajr module, compiled by the first call to luajr_newstate();
+// the mutex guards its creation, as lua_parallel opens states concurrently
 static std::string luajr_module_bytecode;
+static std::mutex luajr_module_bytecode_mutex;
 
 // Path to debugger.lua
 static std::string luajr_debugger_path;
@@ -100,20 +125,65 @@ extern "C" SEXP luajr_reset()
 // Helper function to create a fresh Lua state with the required libraries
 // and with the JIT compiler loaded.
 extern "C" lua_State* luajr_newstate()
+{
+    char buf[1024];
+    lua_State* l = luajr_trynewstate(buf);
+    if (!l)
+        Rf_error("%s", buf);
+    return l;
+}
+
+// Helper for luajr_trynewstate: if err is a Lua error, write its message to
+// buf, close l and return true.
+static bool newstate_failed(lua_State* l, int err, const char* what, char* buf)
+{
+    if (err == 0)
+        return false;
+    luajr_handle_lua_error(l, err, what, buf);
+    lua_close(l);
+    return true;
+}
+
+// Helper for luajr_trynewstate: run str in l, returning any Lua error code
+// with the error on the top of the stack.
+static int newstate_dostring(lua_State* l, const char* str)
+{
+    int err = luaL_loadstring(l, str);
+    if (err == 0)
+        err = luajr_pcall(l, 0, LUA_MULTRET, "string", LUAJR_TOOLING_NONE | LUAJR_NO_ERROR_HANDLING);
+    return err;
+}
+
+// As luajr_newstate(), but rather than raising an R error on failure, write
+// the error message to buf (of at least 1024 characters) and return NULL.
+// This can be called from several threads at once (e.g. by lua_parallel's
+// worker threads).
+extern "C" lua_State* luajr_trynewstate(char* buf)
 {
     // Create new state and open standard libraries; also enables JIT compiler
     lua_State* l = luaL_newstate();
+    if (!l)
+    {
+        snprintf(buf, 1024, "Could not create a new Lua state: not enough memory.");
+        return 0;
+    }
     luaL_openlibs(l);
 
-    // Get bytecode for luajr Lua module
+    // Get bytecode for luajr Lua module. Once made, the bytecode does not
+    // change, so it can be read without holding the mutex.
+    std::unique_lock<std::mutex> lock { luajr_module_bytecode_mutex };
     if (luajr_module_bytecode.empty())
     {
         // Call string.dump(luajr_module_source, true)
         lua_getglobal(l, "string");
         lua_getfield(l, -1, "dump");
-        luajr_loadfile(l, luajr_module_path.c_str());
+        if (newstate_failed(l, luaL_loadfile(l, luajr_module_path.c_str()), "file", buf))
+            return 0;
         lua_pushboolean(l, true);
-        luajr_pcall(l, 2, 1, "string.dump() to precompile luajr Lua module", LUAJR_TOOLING_NONE);
+        if (newstate_failed(l, luajr_pcall(l, 2, 1, "string.dump() to precompile luajr Lua module",
+                LUAJR_TOOLING_NONE | LUAJR_NO_ERROR_HANDLING),
+                "string.dump() to precompile luajr Lua module", buf))
+            return 0;
 
         // Save results of string.dump
         size_t bytecode_len;
@@ -121,18 +191,25 @@ extern "C" lua_State* luajr_newstate()
         luajr_module_bytecode.assign(bytecode, bytecode_len);
         lua_pop(l, 2); // results of string.dump and "string"
     }
+    lock.unlock();
 
     // Load luajr bytecode
-    luajr_loadbuffer(l, luajr_module_bytecode.data(), luajr_module_bytecode.size(), "=luajr module");
+    if (newstate_failed(l, luaL_loadbuffer(l, luajr_module_bytecode.data(),
+            luajr_module_bytecode.size(), "=luajr module"), "buffer", buf))
+        return 0;
 
     // Run script: takes as arguments the full path to the luajr dylib and the
     // path to debugger.lua.
     lua_pushstring(l, luajr_dylib_path.c_str());
     lua_pushstring(l, luajr_debugger_path.c_str());
-    luajr_pcall(l, 2, 0, "luajr Lua module from luajr_newstate()", LUAJR_TOOLING_NONE);
+    if (newstate_failed(l, luajr_pcall(l, 2, 0, "luajr Lua module from luajr_newstate()",
+            LUAJR_TOOLING_NONE | LUAJR_NO_ERROR_HANDLING),
+            "luajr Lua module from luajr_newstate()", buf))
+        return 0;
 
     // Open luajr module
-    luajr_dostring(l, "luajr = require 'luajr'", LUAJR_TOOLING_NONE);
+    if (newstate_failed(l, newstate_dostring(l, "luajr = require 'luajr'"), "string", buf))
+        return 0;
 
     // Save a few key luajr functions to the registry
     lua_getglobal(l, "luajr");
@@ -147,6 +224,37 @@ extern "C" lua_State* luajr_newstate()
 
     lua_pop(l, 1); // luajr
 
+    // Also save ffi.new() to the registry, for constructing reference types
+    // directly from C++ (see push_R_ref() in push_to.cpp)
+    lua_pushlightuserdata(l, (void*)&luajr_ffi_new);
+    if (newstate_failed(l, newstate_dostring(l, "return require('ffi').new"), "string", buf))
+        return 0;
+    lua_rawset(l, LUA_REGISTRYINDEX);
+
+    // Also save the character vector, list and chunked view metatables to the
+    // registry, for converting these types directly from C++ (see push_to.cpp)
+    lua_pushlightuserdata(l, (void*)&luajr_character_mt);
+    if (newstate_failed(l, newstate_dostring(l, "return getmetatable(luajr.character())"), "string", buf))
+        return 0;
+    lua_rawset(l, LUA_REGISTRYINDEX);
+    lua_pushlightuserdata(l, (void*)&luajr_list_mt);
+    if (newstate_failed(l, newstate_dostring(l, "return getmetatable(luajr.list())"), "string", buf))
+        return 0;
+    lua_rawset(l, LUA_REGISTRYINDEX);
+    lua_pushlightuserdata(l, (void*)&luajr_chunked_mt);
+    if (newstate_failed(l, newstate_dostring(l, "return getmetatable(luajr.chunked({}))"), "string", buf))
+        return 0;
+    lua_rawset(l, LUA_REGISTRYINDEX);
+
+    // Gather the above into the table of helpers used for batches of
+    // conversions between R and Lua (see push_to.cpp)
+    if (luajr_conv_register(l) != 0)
+    {
+        lua_close(l);
+        snprintf(buf, 1024, "Too many luajr cdata types.");
+        return 0;
+    }
+
     // Create luajrx table in registry
     lua_newtable(l);
     lua_setfield(l, LUA_REGISTRYINDEX, "luajrx");
@@ -169,7 +277,10 @@ extern "C" lua_State* luajr_getstate(SEXP Lx)
     {
         lua_State* l = reinterpret_cast<lua_State*>(luajr_getpointer(Lx, LUAJR_STATE_CODE));
         if (l)
+        {
+            RegistryEntry::CheckNotBusy(l);
             return l;
+        }
     }
 
     Rf_error("Lua state should be NULL or a value returned from lua_open.");
@@ -6,6 +6,8 @@
 #include <vector>
 #include <string>
 #include <algorithm>
+#include <atomic>
+#include <mutex>
 extern "C" {
 #include "lua.h"
 #include "lauxlib.h"
@@ -19,9 +21,26 @@ static std::string debug_mode = "off";
 static std::string profile_mode = "off";
 static std::string jit_mode = "on";
 
+// The tooling needed by the modes above, as a bitmask of the flags below, so
+// that luajr_pcall() can check for all of them at once. Set by
+// luajr_set_mode(); atomic as it is also read by lua_parallel's threads.
+enum { TOOL_DEBUG_ERROR = 1, TOOL_DEBUG_STEP = 2, TOOL_PROFILE = 4, TOOL_JIT_OFF = 8 };
+static std::atomic<int> tool_mask { 0 };
+
+// Profile data collected from each Lua state, with the strings stored once in
+// profile_pool (whose elements never move, so they can be pointed to).
+// Guarded by profile_mutex, as profile data may be collected from any
+// thread; profile_mutex also guards reads of profile_mode from luajr_pcall(),
+// which may be running in other threads when it changes. It is only taken
+// when profiling, once when a call starts to be profiled and once per
+// collection, never on the untooled path of luajr_pcall().
 static std::unordered_set<std::string> profile_pool;
-typedef std::unordered_set<std::string>::iterator pool_it;
-static std::map<lua_State*, std::vector<pool_it>> profile_data;
+static std::map<lua_State*, std::vector<const std::string*>> profile_data;
+static std::mutex profile_mutex;
+
+// LuaJIT's profiler can only sample one Lua state at a time, so the state
+// being profiled claims it for the length of its call to luajr_pcall().
+static std::atomic<lua_State*> profile_owner { 0 };
 
 static std::vector<std::string> debug_modes { "step", "error", "off" };
 static std::vector<std::string> profile_modes;
@@ -131,27 +150,43 @@ extern "C" void luajr_loadbuffer(lua_State *L, const char *buff, unsigned int sz
     luajr_handle_lua_error(L, luaL_loadbuffer(L, buff, sz, name), "buffer", 0);
 }
 
-// Buffer for error messages from luajr_handle_lua_error
-// The use of this is what makes this function non-thread-safe unless
-// LUAJR_NO_ERROR_HANDLING is set.
-static char errbuf[1024];
-
 // Like lua_pcall, but produce an R error on failure (unless the flag
 // LUAJR_NO_ERROR_HANDLING is set), and with support for luajr tooling.
-// Note: this function is only thread-safe with LUAJR_NO_ERROR_HANDLING
-// and LUAJR_NO_PROFILE_COLLECT set.
+// Note: this function can be called from several threads at once, each with
+// its own Lua state, as long as LUAJR_NO_ERROR_HANDLING is set (since R errors
+// can only be raised from R's main thread) and the debugger is off. If the
+// profiler is on, a call is profiled only if no other state holds the
+// profiler when it starts; otherwise it runs unprofiled.
 extern "C" int luajr_pcall(lua_State* L, int nargs, int nresults, const char* what, int tooling)
 {
     // Note: this currently assumes that there will be no errors in any Lua
     // code or commands run here, except for potentially in the pcall itself.
 
+    // Tooling for this call, read once so that the post run matches the pre
+    // run even if the modes are changed in the meantime.
+    int tools = (tooling & LUAJR_TOOLING_ALL) ? tool_mask.load(std::memory_order_relaxed) : 0;
+
     // Stack index of debugger.lua's error handler (zero if inactive)
     int errfunc = 0;
 
-    // Pre run: Activate debugger, profiler, JIT setttings.
-    if (tooling & LUAJR_TOOLING_ALL)
+    // Whether this call is being profiled, and any error starting the profiler
+    bool profiling = false;
+    int start_err = 0;
+
+    // Keep track if there was an error in the call
+    int lua_err;
+
+    if (tools == 0)
+    {
+        // Fast path: no tooling, so there is nothing to do around the call.
+        lua_err = lua_pcall(L, nargs, nresults, 0);
+        if (lua_err == LUA_OK)
+            return LUA_OK;
+    }
+    else
     {
-        if (debug_mode == "error")
+        // Pre run: Activate debugger, profiler, JIT setttings.
+        if (tools & TOOL_DEBUG_ERROR)
         {
             // Activate debugger on error.
     	    // Grab the error handler (dbg.msgh function)
@@ -163,7 +198,7 @@ extern "C" int luajr_pcall(lua_State* L, int nargs, int nresults, const char* wh
 	        errfunc = lua_gettop(L) - (1 + nargs);
 	        lua_insert(L, errfunc);
         }
-        else if (debug_mode == "step")
+        else if (tools & TOOL_DEBUG_STEP)
         {
             // Step through each line of code.
 
@@ -182,35 +217,64 @@ extern "C" int luajr_pcall(lua_State* L, int nargs, int nresults, const char* wh
             ++nargs; // The "original" function is the new 1st argument
         }
 
-        if (profile_mode != "off")
+        if (tools & TOOL_PROFILE)
         {
             // Any profiling mode: Start the profiler, with profile_mode an
-            // argument to the code in profile_start (defined above).
-            luajr_loadstring(L, profile_start);
-            lua_pushstring(L, profile_mode.c_str());
-            luajr_pcall(L, 1, LUA_MULTRET, "profile start", tooling & ~LUAJR_TOOLING_ALL);
+            // argument to the code in profile_start (defined above), unless
+            // it is in use by another state (or by an outer call in this one).
+            // If the profiler cannot be started, the state lets go of it
+            // again, and the error is reported in place of the call's.
+            lua_State* free_state = 0;
+            profiling = profile_owner.compare_exchange_strong(free_state, L);
+            if (profiling)
+            {
+                start_err = luaL_loadstring(L, profile_start);
+                if (start_err == 0)
+                {
+                    {
+                        std::lock_guard<std::mutex> lock { profile_mutex };
+                        lua_pushstring(L, profile_mode.c_str());
+                    }
+                    start_err = luajr_pcall(L, 1, 0, "profile start",
+                        (tooling & ~LUAJR_TOOLING_ALL) | LUAJR_NO_ERROR_HANDLING);
+                }
+                if (start_err != 0)
+                {
+                    luaJIT_profile_stop(L);
+                    profile_owner = 0;
+                    profiling = false;
+                }
+            }
         }
 
-        if (jit_mode == "off")
+        if (tools & TOOL_JIT_OFF)
         {
             // JIT mode off: turn off JIT compiler.
             luaJIT_setmode(L, 0, LUAJIT_MODE_ENGINE | LUAJIT_MODE_OFF);
         }
-    }
 
-    // Do the call, keeping track if there was an error
-    int lua_err = lua_pcall(L, nargs, nresults, errfunc);
+        // Do the call, or, if the profiler could not be started, replace the
+        // function and its arguments with the error, as lua_pcall would
+        if (start_err == 0)
+        {
+            lua_err = lua_pcall(L, nargs, nresults, errfunc);
+        }
+        else
+        {
+            lua_insert(L, -(nargs + 2));
+            lua_pop(L, nargs + 1);
+            lua_err = start_err;
+            what = "profile start";
+        }
 
-    // Post run
-    if (tooling & LUAJR_TOOLING_ALL)
-    {
-        if (debug_mode == "error")
+        // Post run
+        if (tools & TOOL_DEBUG_ERROR)
         {
             // Debug on error: remove the error handler from the stack.
 	        lua_remove(L, errfunc);
         }
 
-        if (debug_mode != "off")
+        if (tools & (TOOL_DEBUG_ERROR | TOOL_DEBUG_STEP))
         {
             // Any debug mode: clear debugger.lua's hook.
             // This is a call to debug.sethook(). We don't want to actually
@@ -222,19 +286,22 @@ extern "C" int luajr_pcall(lua_State* L, int nargs, int nresults, const char* wh
             lua_pop(L, 1); // debug
         }
 
-        if (profile_mode != "off")
+        if (profiling)
         {
             // Any profiling mode: collect the profiling data in profile_data
 
-            // Stop the profiler
-            luajr_dostring(L, "require 'jit.profile'.stop()", tooling & ~LUAJR_TOOLING_ALL);
+            // Stop the profiler, and only then let other states use it. This
+            // calls LuaJIT directly rather than running jit.profile.stop(),
+            // which could be interrupted (e.g. by lua_parallel's stop hook).
+            luaJIT_profile_stop(L);
+            profile_owner = 0;
 
-            // Profile collection is not thread-safe, so make this optional
+            // Collection can be left until later, e.g. to do it in one go
             if (!(tooling & LUAJR_NO_PROFILE_COLLECT))
                 luajr_profile_collect(L);
         }
 
-        if (jit_mode == "off")
+        if (tools & TOOL_JIT_OFF)
         {
             // JIT mode off: turn JIT back on.
             luaJIT_setmode(L, 0, LUAJIT_MODE_ENGINE | LUAJIT_MODE_ON);
@@ -247,7 +314,9 @@ extern "C" int luajr_pcall(lua_State* L, int nargs, int nresults, const char* wh
         return lua_err;
     }
 
-    // Get the error using our static errbuf
+    // Get the error; the buffer is local, so that other threads can use
+    // luajr_pcall() while the error is being raised
+    char errbuf[1024];
     int errcode = luajr_handle_lua_error(L, lua_err, what, errbuf);
 
     // Propagate error
@@ -300,9 +369,17 @@ extern "C" SEXP luajr_set_mode(SEXP debug, SEXP profile, SEXP jit)
     const char* jit_str = arg(jit, "jit", jit_mode, "on", jit_modes);
 
     debug_mode = debug_str;
-    profile_mode = profile_str;
+    {
+        std::lock_guard<std::mutex> lock { profile_mutex };
+        profile_mode = profile_str;
+    }
     jit_mode = jit_str;
 
+    tool_mask = (debug_mode == "error" ? TOOL_DEBUG_ERROR : 0) |
+        (debug_mode == "step" ? TOOL_DEBUG_STEP : 0) |
+        (profile_mode != "off" ? TOOL_PROFILE : 0) |
+        (jit_mode == "off" ? TOOL_JIT_OFF : 0);
+
     return R_NilValue;
 }
 
@@ -327,20 +404,19 @@ extern "C" SEXP luajr_get_mode()
 // Is debugger on?
 extern "C" int luajr_debug_mode()
 {
-    if (debug_mode == "off")
-        return LUAJR_DEBUG_MODE_OFF;
-    else if (debug_mode == "error")
+    int tools = tool_mask.load(std::memory_order_relaxed);
+    if (tools & TOOL_DEBUG_ERROR)
         return LUAJR_DEBUG_MODE_ERROR;
-    else if (debug_mode == "step")
+    else if (tools & TOOL_DEBUG_STEP)
         return LUAJR_DEBUG_MODE_STEP;
     else
-        Rf_error("Invalid debug mode \"%s\" set.", debug_mode.c_str());
+        return LUAJR_DEBUG_MODE_OFF;
 }
 
 // Is profiler on?
 extern "C" int luajr_profile_mode()
 {
-    if (profile_mode == "off")
+    if (!(tool_mask.load(std::memory_order_relaxed) & TOOL_PROFILE))
         return LUAJR_PROFILE_MODE_OFF;
     else
         return LUAJR_PROFILE_MODE_ON;
@@ -358,25 +434,29 @@ void luajr_profile_collect(lua_State* L)
         return;
     }
 
-    // Find profile data string vector
-    auto pd = profile_data.find(L);
-    if (pd == profile_data.end()) {
-        // first is iterator, second is status code
-        pd = profile_data.emplace(L, std::vector<pool_it>()).first;
-    }
-
-    // Iterate through profile data
-    lua_pushnil(L);
-    while (lua_next(L, -2) != 0)
     {
+        std::lock_guard<std::mutex> lock { profile_mutex };
+
+        // Find profile data string vector
+        auto pd = profile_data.find(L);
+        if (pd == profile_data.end()) {
+            // first is iterator, second is status code
+            pd = profile_data.emplace(L, std::vector<const std::string*>()).first;
+        }
+
+        // Iterate through profile data
         lua_pushnil(L);
         while (lua_next(L, -2) != 0)
         {
-            auto [it, inserted] = profile_pool.insert(lua_tostring(L, -1));
-            pd->second.push_back(it);
+            lua_pushnil(L);
+            while (lua_next(L, -2) != 0)
+            {
+                auto [it, inserted] = profile_pool.insert(lua_tostring(L, -1));
+                pd->second.push_back(&*it);
+                lua_pop(L, 1);
+            }
             lua_pop(L, 1);
         }
-        lua_pop(L, 1);
     }
 
     // Clear profile data in Lua registry
@@ -391,9 +471,20 @@ extern "C" SEXP luajr_profile_data(SEXP flush)
 {
     CheckSEXPLen(flush, LGLSXP, 1);
 
-    SEXP ret = PROTECT(Rf_allocVector(VECSXP, profile_data.size()));
+    // Take the data out of the store (or a copy of it, if not flushing) first,
+    // as the lock must not be held when R allocation might raise an error.
+    std::map<lua_State*, std::vector<const std::string*>> data;
+    {
+        std::lock_guard<std::mutex> lock { profile_mutex };
+        if (LOGICAL(flush)[0] == TRUE)
+            data.swap(profile_data);
+        else
+            data = profile_data;
+    }
+
+    SEXP ret = PROTECT(Rf_allocVector(VECSXP, data.size()));
     size_t j = 0;
-    for (auto& l : profile_data)
+    for (auto& l : data)
     {
         SEXP ptr;
         if (l.first == L0) {
@@ -420,9 +511,6 @@ extern "C" SEXP luajr_profile_data(SEXP flush)
         ++j;
     }
 
-    if (LOGICAL(flush)[0] == TRUE)
-        profile_data.clear();
-
     UNPROTECT(1);
 
     return ret;
@@ -431,5 +519,6 @@ extern "C" SEXP luajr_profile_data(SEXP flush)
 // Remove profiler data for state L (call before lua_close).
 extern "C" void luajr_tooling_cleanup(lua_State* L)
 {
+    std::lock_guard<std::mutex> lock { profile_mutex };
     profile_data.erase(L);
 }